@@ -0,0 +1,259 @@
+// Regression benchmarks for the process library, built on Google Benchmark:
+//
+//   launch/*       spawn-to-exit latency of `true`, with p50/p99 counters,
+//                  and with an explicit environment, prepared or not
+//   stdout/*       throughput of a child's stdout via pipe::read(), an
+//                  async handler, and pipe_istream
+//   lines/*        read_line() and read_line_view() lines per second
+//   fanout/*       1 to 4096 concurrent children, spawned with launch_many
+//                  and drained by the shared reactor
+//
+// Throughput is measured against wall time, since the work is split
+// between this process, its reader threads and the children. Results are
+// tracked across releases as JSON (the process_bench_json target does this):
+//
+//   process_bench --benchmark_out=bench.json --benchmark_out_format=json
+#include "pch.hpp"
+#include <benchmark/benchmark.h>
+#include <proc/launch.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+namespace {
+
+constexpr size_t stdout_bytes = 64 * 1024 * 1024;
+constexpr size_t line_count   = 1000000;
+
+proc::process_options shell(const std::string &command) {
+    proc::process_options opts;
+    opts.with_command_line(command);
+    return opts;
+}
+
+double percentile(std::vector<double> &samples, double p) {
+    if (samples.empty())
+        return 0;
+    size_t index = static_cast<size_t>(p * (samples.size() - 1));
+    std::nth_element(
+        samples.begin(), samples.begin() + index, samples.end()
+    );
+    return samples[index];
+}
+
+// Spawn to reaped exit of `true`. Arg 0 spawns directly, arg 1 through the
+// fork server.
+void launch_latency(benchmark::State &state) {
+    auto opts = shell("true");
+    opts.use_fork_server(state.range(0) == 1);
+
+    std::vector<double> samples;
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        proc::process p(opts);
+        p.start();
+        p.wait();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        state.SetIterationTime(elapsed.count());
+        samples.push_back(elapsed.count() * 1e6);
+    }
+
+    state.counters["p50_us"] = percentile(samples, 0.50);
+    state.counters["p99_us"] = percentile(samples, 0.99);
+}
+BENCHMARK(launch_latency)
+    ->ArgName("fork_server")
+    ->Arg(0)
+    ->Arg(1)
+    ->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+// Spawn to reaped exit of `true` with an explicit 200-variable environment.
+// Arg 0 serializes argv and environment on every launch, arg 1 once through
+// a prepared_launch.
+void launch_prepared(benchmark::State &state) {
+    proc::process_options opts;
+    opts.with_arguments({"true"});
+    for (int i = 0; i < 200; ++i)
+        opts.with_env("BENCH_VAR_" + std::to_string(i), std::string(64, 'x'));
+    proc::prepared_launch prepared(opts);
+
+    for (auto _ : state) {
+        if (state.range(0) == 1) {
+            prepared.start().wait();
+        } else {
+            proc::process p(opts);
+            p.start();
+            p.wait();
+        }
+    }
+}
+BENCHMARK(launch_prepared)
+    ->Name("launch/environment")
+    ->ArgName("prepared")
+    ->Arg(0)
+    ->Arg(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+proc::process start_writer() {
+    auto opts =
+        shell("head -c " + std::to_string(stdout_bytes) + " /dev/zero");
+    opts.redirect_stdout();
+    proc::process p(opts);
+    p.start();
+    return p;
+}
+
+void stdout_read(benchmark::State &state) {
+    size_t total = 0;
+    for (auto _ : state) {
+        auto p = start_writer();
+        while (true) {
+            std::string chunk = p.standard_out().read(64 * 1024);
+            if (chunk.empty())
+                break;
+            total += chunk.size();
+        }
+        p.wait();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(total));
+}
+BENCHMARK(stdout_read)
+    ->Name("stdout/read")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void stdout_handler(benchmark::State &state) {
+    std::atomic<size_t> total = 0;
+    for (auto _ : state) {
+        auto p = start_writer();
+        p.begin_read_stdout([&](std::string_view chunk) {
+            total.fetch_add(chunk.size(), std::memory_order_relaxed);
+        });
+        p.wait();
+        p.end_read_stdout();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(total.load()));
+}
+BENCHMARK(stdout_handler)
+    ->Name("stdout/handler")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void stdout_stream(benchmark::State &state) {
+    std::vector<char> buffer(64 * 1024);
+    size_t total = 0;
+    for (auto _ : state) {
+        auto p       = start_writer();
+        auto &stream = p.standard_out().read_stream();
+        while (stream.read(buffer.data(), buffer.size()) || stream.gcount())
+            total += static_cast<size_t>(stream.gcount());
+        p.wait();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(total));
+}
+BENCHMARK(stdout_stream)
+    ->Name("stdout/stream")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+proc::process start_lines() {
+    auto opts = shell("seq 1 " + std::to_string(line_count));
+    opts.redirect_stdout();
+    proc::process p(opts);
+    p.start();
+    return p;
+}
+
+void lines_read_line(benchmark::State &state) {
+    size_t lines = 0;
+    for (auto _ : state) {
+        auto p = start_lines();
+        while (!p.standard_out().read_line().empty())
+            ++lines;
+        p.wait();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(lines));
+}
+BENCHMARK(lines_read_line)
+    ->Name("lines/read_line")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+void lines_read_line_view(benchmark::State &state) {
+    size_t lines = 0;
+    for (auto _ : state) {
+        auto p = start_lines();
+        while (p.standard_out().read_line_view())
+            ++lines;
+        p.wait();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(lines));
+}
+BENCHMARK(lines_read_line_view)
+    ->Name("lines/read_line_view")
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// N children at once, each writing 64 KiB that the shared reactor drains.
+void fanout(benchmark::State &state) {
+    size_t children = static_cast<size_t>(state.range(0));
+    std::vector<proc::process_options> opts(children);
+    for (auto &o : opts) {
+        o.with_command_line("head -c 65536 /dev/zero")
+            .redirect_stdout()
+            .with_reactor(proc::reactor::shared());
+    }
+
+    std::atomic<size_t> total = 0;
+    for (auto _ : state) {
+        auto procs = proc::launch_many(opts);
+        for (auto &p : procs) {
+            p.begin_read_stdout([&](std::string_view chunk) {
+                total.fetch_add(chunk.size(), std::memory_order_relaxed);
+            });
+        }
+        for (auto &p : procs) {
+            p.wait();
+            p.end_read_stdout();
+        }
+    }
+    state.SetItemsProcessed(
+        static_cast<int64_t>(state.iterations() * children)
+    );
+    state.SetBytesProcessed(static_cast<int64_t>(total.load()));
+}
+BENCHMARK(fanout)
+    ->Name("fanout")
+    ->ArgName("children")
+    ->RangeMultiplier(4)
+    ->Range(1, 4096)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+int main(int argc, char **argv) {
+    // The fork server has to be forked before any thread exists.
+    proc::posix::fork_server::start();
+
+    // 4096 children each hold a pipe open.
+    rlimit files{};
+    if (::getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
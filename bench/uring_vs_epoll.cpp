@@ -0,0 +1,97 @@
+// Compares the epoll reactor with the io_uring engine on many concurrent
+// children that write a lot of output. Each child runs `head -c <bytes>
+// /dev/zero`; the parent counts bytes in the stdout handler and reports wall
+// time, throughput and the CPU time it spent itself.
+//
+// On a single-vCPU 6.18 VM the io_uring engine loses: 1000 children x 4 MiB
+// took about 3.0 s wall / 0.8 s CPU with epoll against 3.8 s / 1.2 s with
+// io_uring, and 500 x 2 MiB about 0.9 s / 0.21 s against 1.1 s / 0.28 s.
+//
+//   uring_vs_epoll [children=1000] [bytes_per_child=4194304]
+#include "pch.hpp"
+#include <proc/launch.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+namespace {
+
+struct result {
+    double wall_ms;
+    double cpu_ms;
+    uint64_t bytes;
+    uint64_t chunks;
+};
+
+double cpu_ms() {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    auto ms = [](const timeval &tv) {
+        return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+    };
+    return ms(usage.ru_utime) + ms(usage.ru_stime);
+}
+
+result run(proc::io_engine &engine, size_t children, size_t bytes) {
+    std::vector<proc::process_options> opts(children);
+    for (auto &o : opts) {
+        o.with_command_line("head -c " + std::to_string(bytes) + " /dev/zero")
+            .redirect_stdout()
+            .with_reactor(engine);
+    }
+
+    std::atomic<uint64_t> total  = 0;
+    std::atomic<uint64_t> chunks = 0;
+    auto cpu_start               = cpu_ms();
+    auto start                   = std::chrono::steady_clock::now();
+
+    auto procs = proc::launch_many(opts);
+    for (auto &p : procs) {
+        p.begin_read_stdout([&](std::string_view chunk) {
+            total.fetch_add(chunk.size(), std::memory_order_relaxed);
+            chunks.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    for (auto &p : procs) {
+        p.wait();
+        p.end_read_stdout();
+    }
+
+    auto wall = std::chrono::steady_clock::now() - start;
+    return {
+        std::chrono::duration<double, std::milli>(wall).count(),
+        cpu_ms() - cpu_start, total.load(), chunks.load()
+    };
+}
+
+void report(const char *name, const result &r) {
+    std::printf(
+        "%-8s %9.1f ms wall %9.1f ms cpu %9.1f MiB/s %8.1f KiB/chunk\n",
+        name, r.wall_ms, r.cpu_ms,
+        r.bytes / (1024.0 * 1024.0) / (r.wall_ms / 1e3),
+        r.chunks ? r.bytes / 1024.0 / r.chunks : 0.0
+    );
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t children = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000;
+    size_t bytes    = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4 << 20;
+
+    proc::reactor epoll_engine(1);
+    report("epoll", run(epoll_engine, children, bytes));
+
+    if (!proc::uring_engine::supported()) {
+        std::printf("io_uring is not available on this kernel.\n");
+        return 0;
+    }
+
+    proc::uring_engine uring;
+    report(uring.multishot() ? "uring-ms" : "uring", run(uring, children, bytes));
+    return 0;
+}
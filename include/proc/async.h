@@ -0,0 +1,344 @@
+#pragma once
+#ifdef __linux__
+#include "handle.h"
+#include "pipe/native_io.h"
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <utility>
+
+namespace proc {
+
+// A lazily started coroutine producing a T. Awaiting it starts it and
+// resumes the awaiter when it finishes; exceptions propagate to the awaiter.
+template <typename T = void> class task;
+
+namespace detail {
+
+    template <typename Promise> struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            auto next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_base {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        void unhandled_exception() noexcept {
+            error = std::current_exception();
+        }
+    };
+
+} // namespace detail
+
+template <typename T> class task {
+  public:
+    struct promise_type : detail::promise_base {
+        std::optional<T> value;
+
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this)
+            );
+        }
+
+        detail::final_awaiter<promise_type> final_suspend() const noexcept {
+            return {};
+        }
+
+        template <typename U> void return_value(U &&v) {
+            value.emplace(std::forward<U>(v));
+        }
+    };
+
+  private:
+    std::coroutine_handle<promise_type> h_;
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+  public:
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~task() {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+
+    T await_resume() {
+        if (h_.promise().error)
+            std::rethrow_exception(h_.promise().error);
+        return std::move(*h_.promise().value);
+    }
+};
+
+template <> class task<void> {
+  public:
+    struct promise_type : detail::promise_base {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this)
+            );
+        }
+
+        detail::final_awaiter<promise_type> final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() const noexcept {}
+    };
+
+  private:
+    std::coroutine_handle<promise_type> h_;
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+  public:
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~task() {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+
+    void await_resume() {
+        if (h_.promise().error)
+            std::rethrow_exception(h_.promise().error);
+    }
+};
+
+// Where suspended coroutines wait for descriptors to become ready. The
+// executor that is running on a thread is reachable through current(), which
+// is how the pipe and process awaitables find it.
+class executor {
+    static executor *&current_slot() {
+        thread_local executor *slot = nullptr;
+        return slot;
+    }
+
+  protected:
+    size_t outstanding_ = 0;
+    std::exception_ptr error_;
+
+    struct scope {
+        executor *previous;
+        explicit scope(executor *e) : previous(current_slot()) {
+            current_slot() = e;
+        }
+        ~scope() { current_slot() = previous; }
+    };
+
+  public:
+    virtual ~executor() = default;
+
+    // Resumes `h` once `fd` reports `events` (EPOLLIN / EPOLLOUT).
+    virtual void watch(
+        native_handle_t fd, uint32_t events, std::coroutine_handle<> h
+    ) = 0;
+
+    // Resumes `h` on the next turn of the loop.
+    virtual void post(std::coroutine_handle<> h) = 0;
+
+    // Drives spawned tasks until all of them have finished. The first
+    // exception escaping a spawned task is rethrown from here.
+    virtual void run() = 0;
+
+    static executor &current() {
+        executor *e = current_slot();
+        if (!e)
+            throw std::runtime_error("No executor is running on this thread.");
+        return *e;
+    }
+
+    // Starts `t` on this executor; it runs when run() is called.
+    void spawn(task<void> t) {
+        ++outstanding_;
+        post(detach(std::move(t), this).handle);
+    }
+
+    struct ready_awaiter {
+        executor &exec;
+        native_handle_t fd;
+        uint32_t events;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            exec.watch(fd, events, h);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    ready_awaiter readable(native_handle_t fd) { return {*this, fd, EPOLLIN}; }
+    ready_awaiter writable(native_handle_t fd) { return {*this, fd, EPOLLOUT}; }
+
+  private:
+    struct detached {
+        struct promise_type {
+            std::coroutine_handle<promise_type> self() {
+                return std::coroutine_handle<promise_type>::from_promise(*this);
+            }
+            detached get_return_object() { return {self()}; }
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            std::suspend_never final_suspend() const noexcept { return {}; }
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    static detached detach(task<void> t, executor *self) {
+        try {
+            co_await std::move(t);
+        } catch (...) {
+            if (!self->error_)
+                self->error_ = std::current_exception();
+        }
+        --self->outstanding_;
+    }
+};
+
+// Single-threaded executor on top of epoll. Each wait is a one-shot
+// registration, so a suspended read or write costs one epoll_ctl and
+// nothing while it sleeps.
+class epoll_executor : public executor {
+    handle epoll_;
+    std::deque<std::coroutine_handle<>> ready_;
+
+    struct waiters {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+    };
+    std::unordered_map<native_handle_t, waiters> waiting_;
+
+  public:
+    epoll_executor() {
+        epoll_.reset(::epoll_create1(EPOLL_CLOEXEC));
+        if (!epoll_.valid())
+            throw std::runtime_error(
+                "epoll_create1 failed: " + native::last_error()
+            );
+    }
+
+    void watch(
+        native_handle_t fd, uint32_t events, std::coroutine_handle<> h
+    ) override {
+        auto &w = waiting_[fd];
+        (events & EPOLLOUT ? w.writer : w.reader) = h;
+
+        epoll_event ev{};
+        ev.events  = EPOLLONESHOT | (w.reader ? EPOLLIN : 0u) |
+                    (w.writer ? EPOLLOUT : 0u);
+        ev.data.fd = fd;
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_MOD, fd, &ev) != 0 &&
+            (errno != ENOENT ||
+             ::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, fd, &ev) != 0)) {
+            waiting_.erase(fd);
+            throw std::runtime_error(
+                "epoll_ctl failed: " + native::last_error()
+            );
+        }
+    }
+
+    void post(std::coroutine_handle<> h) override { ready_.push_back(h); }
+
+    void run() override {
+        scope active(this);
+        epoll_event events[64];
+
+        while (outstanding_ > 0 || !ready_.empty()) {
+            while (!ready_.empty()) {
+                auto h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+
+            if (error_)
+                std::rethrow_exception(std::exchange(error_, nullptr));
+
+            if (outstanding_ == 0)
+                break;
+            if (waiting_.empty())
+                throw std::runtime_error(
+                    "Executor stalled: tasks are suspended on nothing."
+                );
+
+            int n = ::epoll_wait(epoll_.get(), events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(
+                    "epoll_wait failed: " + native::last_error()
+                );
+            }
+
+            for (int i = 0; i < n; ++i) {
+                auto it = waiting_.find(events[i].data.fd);
+                if (it == waiting_.end())
+                    continue;
+
+                waiters w = it->second;
+                waiting_.erase(it);
+                ::epoll_ctl(
+                    epoll_.get(), EPOLL_CTL_DEL, events[i].data.fd, nullptr
+                );
+
+                // Errors and hangups wake both sides; their next syscall
+                // reports what happened.
+                uint32_t got = events[i].events;
+                bool any     = got & (EPOLLERR | EPOLLHUP);
+                if (w.reader && (any || (got & EPOLLIN)))
+                    ready_.push_back(std::exchange(w.reader, {}));
+                if (w.writer && (any || (got & EPOLLOUT)))
+                    ready_.push_back(std::exchange(w.writer, {}));
+                if (w.reader || w.writer) {
+                    auto h = w.reader ? w.reader : w.writer;
+                    watch(
+                        events[i].data.fd, w.reader ? EPOLLIN : EPOLLOUT, h
+                    );
+                }
+            }
+        }
+    }
+};
+
+} // namespace proc
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+#ifdef _WIN32
+#include <string>
+#include <vector>
+
+namespace proc {
+
+// Joins `args` into a command line that CommandLineToArgvW and the C
+// runtime split back into exactly the same arguments. Arguments without
+// spaces, tabs or quotes are passed through untouched.
+inline std::wstring join_arguments(const std::vector<std::wstring> &args) {
+    std::wstring cmdline;
+    for (auto &arg : args) {
+        if (!cmdline.empty())
+            cmdline += L' ';
+
+        if (!arg.empty() && arg.find_first_of(L" \t\n\v\"") == arg.npos) {
+            cmdline += arg;
+            continue;
+        }
+
+        cmdline += L'"';
+        size_t backslashes = 0;
+        for (wchar_t ch : arg) {
+            if (ch == L'\\') {
+                ++backslashes;
+                continue;
+            }
+            // Backslashes are only special in front of a quote.
+            if (ch == L'"')
+                cmdline.append(backslashes * 2 + 1, L'\\');
+            else
+                cmdline.append(backslashes, L'\\');
+            backslashes = 0;
+            cmdline += ch;
+        }
+        // ... and in front of the closing one.
+        cmdline.append(backslashes * 2, L'\\');
+        cmdline += L'"';
+    }
+    return cmdline;
+}
+
+} // namespace proc
+#endif
@@ -0,0 +1,124 @@
+#pragma once
+#ifdef _WIN32
+#include <Windows.h>
+#include <cwchar>
+#include <map>
+#include <string>
+#else
+#include "posix/spawn.h"
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#endif
+
+namespace proc {
+
+#ifdef _WIN32
+// Windows compares variable names case-insensitively and wants the block
+// sorted the same way.
+struct environment_name_less {
+    bool operator()(const std::wstring &a, const std::wstring &b) const {
+        return ::_wcsicmp(a.c_str(), b.c_str()) < 0;
+    }
+};
+using environment_map =
+    std::map<std::wstring, std::wstring, environment_name_less>;
+#else
+using environment_map = std::map<std::string, std::string>;
+#endif
+
+// An environment serialized into the exact form the OS spawn call takes:
+// a double-NUL terminated UTF-16 block on Windows, a null-terminated envp
+// array elsewhere. Build it once and share it across many launches.
+class environment_block {
+#ifdef _WIN32
+    std::wstring block_;
+#else
+    posix::argv_block entries_;
+#endif
+
+  public:
+    environment_block() = default;
+
+    // Snapshot of the calling process's environment.
+    static environment_block current() {
+        environment_block env;
+#ifdef _WIN32
+        LPWCH strings = ::GetEnvironmentStringsW();
+        if (strings) {
+            const wchar_t *end = strings;
+            while (*end)
+                end += wcslen(end) + 1;
+            env.block_.assign(strings, end + 1);
+            ::FreeEnvironmentStringsW(strings);
+        }
+#else
+        std::vector<std::string> entries;
+        for (char **e = environ; e && *e; ++e)
+            entries.emplace_back(*e);
+        env.entries_ = posix::argv_block(std::move(entries));
+#endif
+        return env;
+    }
+
+    // Exactly the variables in `vars`.
+    static environment_block from(const environment_map &vars) {
+        environment_block env;
+#ifdef _WIN32
+        for (auto &[name, value] : vars) {
+            env.block_ += name;
+            env.block_ += L'=';
+            env.block_ += value;
+            env.block_ += L'\0';
+        }
+        // An empty block still needs both terminators.
+        if (env.block_.empty())
+            env.block_ += L'\0';
+        env.block_ += L'\0';
+#else
+        std::vector<std::string> entries;
+        entries.reserve(vars.size());
+        for (auto &[name, value] : vars)
+            entries.push_back(name + '=' + value);
+        env.entries_ = posix::argv_block(std::move(entries));
+#endif
+        return env;
+    }
+
+    // The calling process's environment as a map, to edit and pass to
+    // from() or process_options::with_environment().
+    static environment_map current_map() {
+        environment_map vars;
+#ifdef _WIN32
+        LPWCH strings = ::GetEnvironmentStringsW();
+        for (const wchar_t *e = strings; e && *e; e += wcslen(e) + 1) {
+            // Skip past the leading '=' of the hidden "=C:=C:\dir" entries.
+            const wchar_t *eq = wcschr(e + 1, L'=');
+            if (eq)
+                vars.emplace(std::wstring(e, eq), std::wstring(eq + 1));
+        }
+        if (strings)
+            ::FreeEnvironmentStringsW(strings);
+#else
+        for (const char *const *e = environ; e && *e; ++e) {
+            const char *eq = std::strchr(*e, '=');
+            if (eq)
+                vars.emplace(std::string(*e, eq), std::string(eq + 1));
+        }
+#endif
+        return vars;
+    }
+
+#ifdef _WIN32
+    // Pass with CREATE_UNICODE_ENVIRONMENT.
+    void *data() const noexcept {
+        return block_.empty() ? nullptr
+                              : const_cast<wchar_t *>(block_.data());
+    }
+#else
+    char *const *data() const noexcept { return entries_.data(); }
+#endif
+};
+
+} // namespace proc
@@ -0,0 +1,159 @@
+#pragma once
+#include "stats.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+namespace proc {
+
+#ifndef _WIN32
+// What is known about a child once it has been reaped.
+struct exit_info {
+    int status    = 0; // raw wait status
+    int exit_code = 0; // exit code, or 128 + signal like a shell reports
+    int signal    = 0; // terminating signal, 0 if it exited normally
+    bool lost     = false; // no status: see exit_state::fail()
+    rusage usage{};
+
+    static exit_info from_status(int status, const rusage &usage) {
+        exit_info info;
+        info.status = status;
+        info.usage  = usage;
+        if (WIFEXITED(status)) {
+            info.exit_code = WEXITSTATUS(status);
+        } else if (WIFSIGNALED(status)) {
+            info.signal    = WTERMSIG(status);
+            info.exit_code = 128 + info.signal;
+        }
+        return info;
+    }
+};
+
+using exit_handler = std::function<void(const exit_info &)>;
+#endif
+
+// Exit information for a child that is reaped by someone other than its
+// process object (the fork server or an exit_watcher), shared between the
+// two.
+class exit_state {
+    mutable std::mutex mutex_;
+    mutable std::condition_variable cv_;
+    bool exited_ = false;
+    int status_  = 0;
+    stats_clock::time_point exited_at_;
+#ifndef _WIN32
+    rusage usage_{};
+    std::vector<exit_handler> handlers_;
+    std::string error_;
+#endif
+
+  public:
+#ifndef _WIN32
+    // Records the exit, releases waiters and then runs the registered
+    // handlers on the calling thread, outside the lock, so a handler sees
+    // the child as exited and may call back into exit_code() or wait().
+    void set(int status, const rusage &usage) {
+        exit_info info = exit_info::from_status(status, usage);
+        auto now       = stats_clock::now();
+        std::vector<exit_handler> handlers;
+        {
+            std::lock_guard lock(mutex_);
+            status_    = status;
+            usage_     = usage;
+            exited_at_ = now;
+            exited_    = true;
+            handlers.swap(handlers_);
+        }
+        cv_.notify_all();
+
+        for (auto &h : handlers)
+            h(info);
+    }
+
+    // Completes the state without a status, when the child was reaped
+    // elsewhere or its reaper went away. Handlers see exit_info::lost and
+    // the owning process reports `reason` as an exception.
+    void fail(std::string reason) {
+        exit_info info;
+        info.lost = true;
+        auto now  = stats_clock::now();
+        std::vector<exit_handler> handlers;
+        {
+            std::lock_guard lock(mutex_);
+            if (exited_)
+                return;
+            error_     = std::move(reason);
+            exited_at_ = now;
+            exited_    = true;
+            handlers.swap(handlers_);
+        }
+        cv_.notify_all();
+
+        for (auto &h : handlers)
+            h(info);
+    }
+
+    // Why the status is unknown, or empty if it isn't.
+    std::string error() const {
+        std::lock_guard lock(mutex_);
+        return error_;
+    }
+
+    rusage usage() const {
+        std::lock_guard lock(mutex_);
+        return usage_;
+    }
+
+    // Runs `handler` once the child exits, or right away if it already has.
+    void on_exit(exit_handler handler) {
+        std::unique_lock lock(mutex_);
+        if (!exited_) {
+            handlers_.push_back(std::move(handler));
+            return;
+        }
+
+        exit_info info = exit_info::from_status(status_, usage_);
+        info.lost      = !error_.empty();
+        lock.unlock();
+        handler(info);
+    }
+#endif
+
+    bool exited() const {
+        std::lock_guard lock(mutex_);
+        return exited_;
+    }
+
+    // When the reaper collected the child.
+    stats_clock::time_point exited_at() const {
+        std::lock_guard lock(mutex_);
+        return exited_at_;
+    }
+
+    // Raw wait status as returned by waitpid().
+    int status() const {
+        std::lock_guard lock(mutex_);
+        return status_;
+    }
+
+    void wait() const {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this]() { return exited_; });
+    }
+
+    template <typename Rep, typename Period>
+    bool wait_for(std::chrono::duration<Rep, Period> timeout) const {
+        std::unique_lock lock(mutex_);
+        return cv_.wait_for(lock, timeout, [this]() { return exited_; });
+    }
+};
+
+} // namespace proc
@@ -0,0 +1,175 @@
+#pragma once
+#ifdef __linux__
+#include "exit_state.h"
+#include "handle.h"
+#include "pipe/native_io.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unordered_map>
+
+namespace proc {
+
+// Opens a pidfd for `pid`, or returns -1 if the kernel lacks pidfd_open.
+inline int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Tracks the exit of many children from one thread. Each child is watched
+// through a pidfd registered with epoll; when it becomes readable the
+// watcher reaps the child with wait4(), capturing its rusage, and completes
+// the child's exit_state (which runs any on_exit handlers on the watcher
+// thread). Nothing polls and nothing blocks per child.
+class exit_watcher {
+    handle epoll_;
+    handle wake_;
+    std::thread thread_;
+    std::atomic<bool> running_ = true;
+
+    struct entry {
+        pid_t pid;
+        handle pidfd;
+        std::shared_ptr<exit_state> state;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<int, entry> entries_;
+
+  public:
+    exit_watcher() {
+        epoll_.reset(::epoll_create1(EPOLL_CLOEXEC));
+        if (!epoll_.valid())
+            throw std::runtime_error(
+                "epoll_create1 failed: " + native::last_error()
+            );
+
+        wake_.reset(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+        if (!wake_.valid())
+            throw std::runtime_error("eventfd failed: " + native::last_error());
+
+        epoll_event ev{};
+        ev.events  = EPOLLIN;
+        ev.data.fd = wake_.get();
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, wake_.get(), &ev) != 0)
+            throw std::runtime_error(
+                "epoll_ctl failed: " + native::last_error()
+            );
+
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    exit_watcher(const exit_watcher &)            = delete;
+    exit_watcher &operator=(const exit_watcher &) = delete;
+
+    ~exit_watcher() {
+        running_ = false;
+        uint64_t one = 1;
+        (void)::write(wake_.get(), &one, sizeof(one));
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    static exit_watcher &shared() {
+        static exit_watcher instance;
+        return instance;
+    }
+
+    size_t watched() {
+        std::lock_guard lock(mutex_);
+        return entries_.size();
+    }
+
+    // Takes over reaping `pid`; `state` is completed when it exits. The
+    // caller must not waitpid() the child itself afterwards.
+    void watch(pid_t pid, std::shared_ptr<exit_state> state) {
+        int fd = open_pidfd(pid);
+        if (fd < 0) {
+            if (errno != ENOSYS && errno != EINVAL)
+                throw std::runtime_error(
+                    "pidfd_open failed: " + native::last_error()
+                );
+
+            // No pidfd support: fall back to a blocking reaper thread.
+            std::thread([pid, state = std::move(state)]() {
+                reap(pid, *state, 0);
+            }).detach();
+            return;
+        }
+
+        std::lock_guard lock(mutex_);
+        epoll_event ev{};
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+            ::close(fd);
+            throw std::runtime_error(
+                "epoll_ctl failed: " + native::last_error()
+            );
+        }
+        entries_.emplace(fd, entry{pid, handle(fd), std::move(state)});
+    }
+
+  private:
+    void run() {
+        epoll_event events[64];
+        while (running_) {
+            int n = ::epoll_wait(epoll_.get(), events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wake_.get())
+                    continue;
+
+                entry e;
+                {
+                    std::lock_guard lock(mutex_);
+                    auto it = entries_.find(fd);
+                    if (it == entries_.end())
+                        continue;
+                    ::epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, fd, nullptr);
+                    e = std::move(it->second);
+                    entries_.erase(it);
+                }
+
+                reap(e.pid, *e.state, WNOHANG);
+            }
+        }
+    }
+
+    static void reap(pid_t pid, exit_state &state, int flags) {
+        int status = 0;
+        rusage usage{};
+        pid_t rc;
+        do {
+            rc = ::wait4(pid, &status, flags, &usage);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc == pid)
+            state.set(status, usage);
+        else if (rc < 0)
+            // Typically ECHILD: someone else reaped the child (or SIGCHLD is
+            // ignored). Its status is gone, but waiters must not hang.
+            state.fail("wait4 failed: " + native::last_error());
+    }
+};
+
+} // namespace proc
+#endif
@@ -1,28 +1,42 @@
 #pragma once
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-#ifdef _PROC_HANDLE
 namespace proc {
+#ifdef _WIN32
+	using native_handle_t = HANDLE;
+	inline const native_handle_t invalid_native_handle = INVALID_HANDLE_VALUE;
+#else
+	using native_handle_t = int;
+	inline constexpr native_handle_t invalid_native_handle = -1;
+#endif
+
+	// Owns a HANDLE on Windows and a file descriptor everywhere else.
 	class handle {
-		HANDLE h_ = INVALID_HANDLE_VALUE;
+		native_handle_t h_ = invalid_native_handle;
 
 	public:
 		handle() noexcept = default;
 
-		explicit handle(HANDLE h) noexcept : h_(h) {}
+		explicit handle(native_handle_t h) noexcept : h_(h) {}
 
 		handle(const handle&) = delete;
 		handle& operator=(const handle&) = delete;
 
 		handle(handle&& other) noexcept : h_(other.h_) {
-			other.h_ = INVALID_HANDLE_VALUE;
+			other.h_ = invalid_native_handle;
 		}
 
 		handle& operator=(handle&& other) noexcept {
 			if (this != &other) {
 				close();
 				h_ = other.h_;
-				other.h_ = INVALID_HANDLE_VALUE;
+				other.h_ = invalid_native_handle;
 			}
 			return *this;
 		}
@@ -32,20 +46,28 @@ namespace proc {
 		}
 
 		bool valid() const noexcept {
+#ifdef _WIN32
 			return h_ && h_ != INVALID_HANDLE_VALUE;
+#else
+			return h_ >= 0;
+#endif
+		}
+
+		explicit operator bool() const noexcept {
+			return valid();
 		}
 
-		HANDLE get() const noexcept {
+		native_handle_t get() const noexcept {
 			return h_;
 		}
 
-		HANDLE release() noexcept {
-			HANDLE temp = h_;
-			h_ = INVALID_HANDLE_VALUE;
+		native_handle_t release() noexcept {
+			native_handle_t temp = h_;
+			h_ = invalid_native_handle;
 			return temp;
 		}
 
-		void reset(HANDLE h = INVALID_HANDLE_VALUE) noexcept {
+		void reset(native_handle_t h = invalid_native_handle) noexcept {
 			if (h_ != h) {
 				close();
 				h_ = h;
@@ -55,10 +77,13 @@ namespace proc {
 	private:
 		void close() noexcept {
 			if (valid()) {
+#ifdef _WIN32
 				::CloseHandle(h_);
-				h_ = INVALID_HANDLE_VALUE;
+#else
+				::close(h_);
+#endif
+				h_ = invalid_native_handle;
 			}
 		}
 	};
 }
-#endif
\ No newline at end of file
@@ -3,17 +3,23 @@
 #include <io/reader.h>
 #include <io/writer.h>
 #include "handle.h"
+#include "pipe/line_reader.h"
 
 #ifdef _PROC_IO
 namespace proc {
 	class pipe_reader : public io::reader {
 		handle read_;
+		line_reader lines_;
 
 	public:
-		explicit pipe_reader(HANDLE h) : read_(h) {}
+		explicit pipe_reader(HANDLE h) : read_(h), lines_(h) {}
 
 		std::string read(size_t max_bytes = 4096) override {
 			std::string buffer(max_bytes, '\0');
+			if (lines_.buffered()) {
+				buffer.resize(lines_.take_buffered(buffer.data(), max_bytes));
+				return buffer;
+			}
 			DWORD bytes_read = 0;
 			if (!::ReadFile(native_handle(), buffer.data(), static_cast<DWORD>(max_bytes), &bytes_read, nullptr)) {
 				if (GetLastError() == ERROR_BROKEN_PIPE) {
@@ -26,17 +32,7 @@ namespace proc {
 		}
 
 		std::string read_line() override {
-			std::string line;
-			char ch;
-			DWORD bytes_read;
-			while (true) {
-				if (!::ReadFile(native_handle(), &ch, 1, &bytes_read, nullptr) || bytes_read == 0) {
-					break;
-				}
-				if (ch == '\n') break;
-				line += ch;
-			}
-			return line;
+			return lines_.read_line();
 		}
 
 		HANDLE native_handle() const { return read_.get(); }
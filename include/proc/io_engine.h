@@ -0,0 +1,38 @@
+#pragma once
+#ifdef __linux__
+#include "handle.h"
+#include <cstdint>
+#include <functional>
+
+namespace proc {
+
+// Something that can service the read ends of many pipes on its own
+// threads: the epoll `reactor`, or the io_uring `uring_engine`. A pipe
+// handed to an engine via pipe::begin_read() is read by the engine until
+// EOF or until it is unwatched.
+class io_engine {
+  public:
+    using watch_id = uint64_t;
+
+    virtual ~io_engine() = default;
+
+    // Starts delivering data from `fd` to `on_data`. Chunks for one pipe
+    // arrive in order and never concurrently. `on_close` runs once, on an
+    // engine thread, after the write end has been closed and all data
+    // delivered.
+    virtual watch_id watch(
+        native_handle_t fd, proc_handler on_data,
+        std::function<void()> on_close = nullptr
+    ) = 0;
+
+    // Stops watching and delivers whatever is already buffered in the pipe
+    // before returning. Must not be called from one of the engine's
+    // handlers.
+    virtual void unwatch(watch_id id) = 0;
+
+    // True until the watched pipe reaches EOF or is unwatched.
+    virtual bool watching(watch_id id) = 0;
+};
+
+} // namespace proc
+#endif
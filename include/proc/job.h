@@ -0,0 +1,200 @@
+#pragma once
+#include "process.h"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#endif
+
+namespace proc {
+
+// Processes that are signalled and waited on as one, together with
+// everything they start. Without this, killing a shell leaves its
+// grandchildren running, and as long as they hold the pipes' write ends
+// every reader waiting for EOF hangs with them.
+//
+// On POSIX the children share a process group led by the first of them;
+// a descendant that calls setsid() or setpgid() leaves the group. On Linux
+// a job can use a cgroup instead, which nothing inside can leave. On
+// Windows it is a job object.
+//
+// Destroying a job kills whatever is still running in it.
+class job {
+#ifdef _WIN32
+    handle job_;
+#else
+    // 0 until the first child starts and becomes the group leader.
+    pid_t group_ = 0;
+#endif
+#ifdef __linux__
+    std::shared_ptr<posix::cgroup> cgroup_;
+#endif
+    // A deque, so references returned by start() stay valid.
+    std::deque<process> processes_;
+
+  public:
+    static constexpr std::chrono::milliseconds default_grace{2000};
+
+    job() {
+#ifdef _WIN32
+        job_.reset(::CreateJobObjectW(nullptr, nullptr));
+        if (!job_.valid()) {
+            throw std::runtime_error(
+                "Cannot create job object: " + winapi::get_last_error()
+            );
+        }
+
+        // Also covers this process dying without running the destructor.
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION info{};
+        info.BasicLimitInformation.LimitFlags =
+            JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        ::SetInformationJobObject(
+            job_.get(), JobObjectExtendedLimitInformation, &info, sizeof(info)
+        );
+#endif
+    }
+
+#ifdef __linux__
+    // A job whose children all start in `group` (see posix::cgroup). Cannot
+    // be combined with the fork server.
+    explicit job(std::shared_ptr<posix::cgroup> group)
+        : cgroup_(std::move(group)) {
+        if (!cgroup_)
+            throw std::runtime_error("No cgroup was supplied.");
+    }
+#endif
+
+    job(const job &)            = delete;
+    job &operator=(const job &) = delete;
+
+    ~job() {
+        try {
+            if (!processes_.empty()) {
+                kill_tree();
+                wait_all();
+            }
+        } catch (...) {
+        }
+    }
+
+    // Starts a process in the job. The job owns it; the reference stays
+    // valid for the job's lifetime.
+    process &start(process_options opts) {
+#ifdef _WIN32
+        opts.with_job(job_.get());
+#else
+#ifdef __linux__
+        if (cgroup_)
+            opts.with_cgroup(cgroup_);
+        else
+#endif
+            opts.with_process_group(live_group());
+#endif
+
+        processes_.emplace_back(opts);
+        try {
+            processes_.back().start();
+        } catch (...) {
+            processes_.pop_back();
+            throw;
+        }
+
+#ifdef __linux__
+        if (cgroup_)
+            return processes_.back();
+#endif
+#ifndef _WIN32
+        if (group_ == 0)
+            group_ = processes_.back().id();
+#endif
+        return processes_.back();
+    }
+
+    size_t size() const noexcept { return processes_.size(); }
+
+    process &at(size_t index) { return processes_.at(index); }
+
+#ifdef _WIN32
+    HANDLE native_handle() const noexcept { return job_.get(); }
+
+    // Terminates every process in the job, descendants included.
+    bool kill_tree(UINT exit_code = 1) {
+        return ::TerminateJobObject(job_.get(), exit_code) != 0;
+    }
+#else
+    // The process group ID, 0 before the first child has started (and for
+    // a cgroup job).
+    pid_t group_id() const noexcept { return group_; }
+
+    // Sends `signal` to every process in the job, descendants included.
+    // Returns false if nothing was left to signal.
+    bool kill_tree(int signal = SIGKILL) {
+#ifdef __linux__
+        if (cgroup_) {
+            // cgroup.kill (Linux 5.14+) also catches processes mid-fork.
+            if (signal == SIGKILL && cgroup_->kill())
+                return true;
+            return cgroup_->signal(signal);
+        }
+#endif
+        if (group_ <= 0)
+            return false;
+        return ::killpg(group_, signal) == 0;
+    }
+#endif
+
+    // Waits for every process started in the job.
+    void wait_all() {
+        for (auto &p : processes_)
+            p.wait();
+    }
+
+    // Waits up to `timeout` for every process started in the job. Returns
+    // true if they have all exited.
+    template <typename Rep, typename Period>
+    bool wait_all(std::chrono::duration<Rep, Period> timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (auto &p : processes_) {
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (!p.wait_for(std::max(left, decltype(left)::zero())))
+                return false;
+        }
+        return true;
+    }
+
+    // Shuts the job down: SIGTERM to the whole tree, up to `grace` for the
+    // children to exit, then SIGKILL for whatever is left, including
+    // descendants that outlived them and still hold pipes open. Returns
+    // true if the children exited within the grace period. On Windows,
+    // which has no SIGTERM, the job is terminated straight away.
+    bool terminate(std::chrono::milliseconds grace = default_grace) {
+#ifdef _WIN32
+        grace = std::chrono::milliseconds(0);
+#else
+        kill_tree(SIGTERM);
+        // A stopped process would not act on SIGTERM until resumed.
+        kill_tree(SIGCONT);
+#endif
+        bool graceful = wait_all(grace);
+        kill_tree();
+        wait_all();
+        return graceful;
+    }
+
+  private:
+#ifndef _WIN32
+    // The group for the next child to join, or 0 to lead a new one. Once
+    // every member has gone the group ID is free to be reused, so it can
+    // no longer be joined.
+    pid_t live_group() {
+        if (group_ > 0 && ::killpg(group_, 0) != 0 && errno == ESRCH)
+            group_ = 0;
+        return group_;
+    }
+#endif
+};
+
+} // namespace proc
@@ -0,0 +1,142 @@
+#pragma once
+#include "environment.h"
+#include "process.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace proc {
+
+// Starts one process per entry in `opts` and returns them in the same
+// order. Setup is amortized across the batch: every pipe is created up
+// front, the environment is serialized once and shared by all children, and
+// the spawns themselves are spread over `threads` workers (0 picks a small
+// default). If any spawn fails, the children already started are killed and
+// the first error is rethrown.
+inline std::vector<process>
+launch_many(std::span<process_options> opts, size_t threads = 0) {
+    std::vector<process> procs;
+    procs.reserve(opts.size());
+    for (auto &o : opts)
+        procs.emplace_back(o);
+
+    if (procs.empty())
+        return procs;
+
+    for (auto &p : procs)
+        p.create_pipes();
+
+    const environment_block env = environment_block::current();
+    for (auto &p : procs)
+        p.environment_ = &env;
+
+#ifdef _WIN32
+    // Inheritable pipe handles created for one child would leak into any
+    // sibling spawned concurrently, so Windows spawns are serialized.
+    threads = 1;
+#else
+    if (threads == 0)
+        threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 8);
+#endif
+    threads = std::min(threads, procs.size());
+
+    std::atomic<size_t> next = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto spawn_some = [&]() {
+        for (size_t i = next++; i < procs.size(); i = next++) {
+            try {
+                procs[i].start();
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = procs.size();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back(spawn_some);
+    spawn_some();
+    for (auto &w : workers)
+        w.join();
+
+    for (auto &p : procs)
+        p.environment_ = nullptr;
+
+    if (error) {
+        for (auto &p : procs) {
+            if (p.started_) {
+                p.kill();
+                p.wait();
+            }
+        }
+        std::rethrow_exception(error);
+    }
+
+    return procs;
+}
+
+// A process_options whose argv and environment have been serialized once,
+// into the exact form the spawn call takes (an argv/envp array, or a quoted
+// command line and a UTF-16 block on Windows), for starting the same
+// command over and over. Each start() then skips splitting, converting and
+// copying those strings.
+class prepared_launch {
+    process_options opts_;
+
+  public:
+    explicit prepared_launch(process_options opts) : opts_(std::move(opts)) {
+        auto blocks = std::make_shared<process_options::launch_blocks>();
+        // Shared regions add to the environment on every start.
+        bool env_fixed = true;
+#ifdef __linux__
+        env_fixed = opts_.shared_regions_.empty();
+#endif
+        if (opts_.environment && env_fixed) {
+            blocks->environment = environment_block::from(*opts_.environment);
+            opts_.environment.reset();
+        }
+#ifdef _WIN32
+        if (opts_.command_line.empty() && !opts_.arguments.empty())
+            opts_.command_line = join_arguments(opts_.arguments);
+#else
+        blocks->argv = opts_.command_line.empty() && !opts_.arguments.empty()
+                           ? posix::argv_block(opts_.arguments)
+                           : posix::build_argv(
+                                 opts_.application.string(), opts_.command_line
+                             );
+#endif
+        // Baked into the blocks, so no longer copied into each process.
+        opts_.arguments.clear();
+        opts_.prepared_ = std::move(blocks);
+    }
+
+    process start() const {
+        process p(opts_);
+        p.start();
+        return p;
+    }
+
+    friend std::vector<process>
+    launch_many(const prepared_launch &, size_t, size_t);
+};
+
+// Starts `count` copies of a prepared launch (see the overload above).
+inline std::vector<process> launch_many(
+    const prepared_launch &launch, size_t count, size_t threads = 0
+) {
+    std::vector<process_options> opts(count, launch.opts_);
+    return launch_many(std::span<process_options>(opts), threads);
+}
+
+} // namespace proc
@@ -0,0 +1,350 @@
+#pragma once
+#include "../handle.h"
+#include "../stats.h"
+#include "native_io.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <winapi/utils.h>
+#else
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace proc {
+
+inline constexpr size_t default_write_high_water_mark = 1024 * 1024;
+
+// Feeds a pipe from a background thread. write() only queues the buffer, so
+// callers never wait on the child; the thread takes everything queued since
+// its last pass and hands it to the kernel in a single writev(), so a
+// stream of small records costs one syscall per batch rather than per
+// record.
+//
+// The queue is a lock-free intrusive stack: producers push with a CAS and
+// the thread takes the whole stack with one exchange, then reverses it back
+// into FIFO order. The thread is only woken when the queue goes from empty
+// to non-empty.
+//
+// Once more than `high_water_mark` bytes are waiting, write() blocks until
+// the child catches up (try_write() refuses instead). That is the
+// back-pressure: a child that stops reading stalls the producer rather than
+// growing the queue without bound.
+class async_writer {
+    struct node {
+        node *next = nullptr;
+        std::string data;
+        bool last = false;
+    };
+
+    native_handle_t handle_;
+    size_t high_water_mark_;
+    io_counters *counters_;
+
+    std::atomic<node *> head_         = nullptr;
+    std::atomic<uint64_t> pending_    = 0;
+    std::atomic<bool> closed_         = false;
+    std::atomic<bool> stopping_       = false;
+    std::atomic<bool> failed_         = false;
+    // Set when the thread has finished, however it got there; abandoned_
+    // when it left queued data behind.
+    std::atomic<bool> stopped_        = false;
+    std::atomic<bool> abandoned_      = false;
+    std::exception_ptr error_;
+
+#ifndef _WIN32
+    // Written to by stop() to wake the thread out of poll().
+    handle wake_read_;
+    handle wake_write_;
+#endif
+    std::thread thread_;
+
+  public:
+    // The caller keeps ownership of `h` and must keep it open until the
+    // writer is closed or destroyed. On POSIX the writer switches it to
+    // O_NONBLOCK, so other blocking writes should not be mixed in. Each
+    // write call is recorded in `counters` when given.
+    explicit async_writer(
+        native_handle_t h,
+        size_t high_water_mark = default_write_high_water_mark,
+        io_counters *counters  = nullptr
+    )
+        : handle_(h), high_water_mark_(high_water_mark ? high_water_mark : 1),
+          counters_(counters) {
+#ifndef _WIN32
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0)
+            throw std::runtime_error("pipe2 failed: " + native::last_error());
+        wake_read_.reset(fds[0]);
+        wake_write_.reset(fds[1]);
+
+        int flags = ::fcntl(handle_, F_GETFL);
+        if (flags >= 0 && !(flags & O_NONBLOCK))
+            ::fcntl(handle_, F_SETFL, flags | O_NONBLOCK);
+#endif
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    async_writer(const async_writer &)            = delete;
+    async_writer &operator=(const async_writer &) = delete;
+
+    // Abandons whatever has not been written yet.
+    ~async_writer() {
+        stop();
+        free_list(head_.exchange(nullptr));
+    }
+
+    // Queues `data`, blocking while the queue is above the high-water mark.
+    // Throws if an earlier write failed (e.g. the child closed its stdin) or
+    // the writer has been stopped.
+    void write(std::string data) {
+        if (data.empty())
+            return;
+        check_open();
+
+        uint64_t pending = pending_.load(std::memory_order_acquire);
+        while (pending >= high_water_mark_ && !stopped_.load()) {
+            pending_.wait(pending, std::memory_order_acquire);
+            pending = pending_.load(std::memory_order_acquire);
+        }
+        check_open();
+
+        enqueue(std::move(data));
+    }
+
+    // Queues `data` unless the queue is at the high-water mark, in which case
+    // it returns false and leaves `data` alone.
+    bool try_write(std::string &data) {
+        check_open();
+        if (pending_.load(std::memory_order_acquire) >= high_water_mark_)
+            return false;
+        if (!data.empty())
+            enqueue(std::move(data));
+        return true;
+    }
+
+    // Bytes queued but not yet accepted by the pipe.
+    uint64_t pending_bytes() const noexcept {
+        return pending_.load(std::memory_order_acquire);
+    }
+
+    size_t high_water_mark() const noexcept { return high_water_mark_; }
+
+    // Blocks until everything queued so far has been written. Throws if
+    // the writer failed or was stopped first.
+    void flush() {
+        uint64_t pending = pending_.load(std::memory_order_acquire);
+        while (pending != 0 && !stopped_.load()) {
+            pending_.wait(pending, std::memory_order_acquire);
+            pending = pending_.load(std::memory_order_acquire);
+        }
+        rethrow_error();
+        if (abandoned_.load(std::memory_order_acquire))
+            throw std::runtime_error(
+                "Writer stopped before everything was written."
+            );
+    }
+
+    // Writes out everything queued, then stops the thread. Does not close
+    // the handle. Rethrows the error that stopped the writer, if any.
+    void close() {
+        if (!closed_.exchange(true))
+            push(new node{nullptr, {}, true});
+        if (thread_.joinable())
+            thread_.join();
+        rethrow_error();
+    }
+
+    // Abandons whatever has not been written yet and stops the thread.
+    // Later write() and flush() calls throw.
+    void stop() {
+        if (!thread_.joinable())
+            return;
+        stopping_ = true;
+        push(new node{nullptr, {}, true});
+#ifdef _WIN32
+        ::CancelSynchronousIo(thread_.native_handle());
+#else
+        char signal = 1;
+        (void)::write(wake_write_.get(), &signal, 1);
+#endif
+        thread_.join();
+    }
+
+  private:
+    void check_open() {
+        if (closed_.load())
+            throw std::runtime_error("Writer already closed.");
+        rethrow_error();
+        if (stopped_.load())
+            throw std::runtime_error("Writer stopped.");
+    }
+
+    void rethrow_error() {
+        if (failed_.load(std::memory_order_acquire))
+            std::rethrow_exception(error_);
+    }
+
+    void enqueue(std::string data) {
+        pending_.fetch_add(data.size(), std::memory_order_relaxed);
+        push(new node{nullptr, std::move(data), false});
+    }
+
+    void push(node *n) {
+        n->next = head_.load(std::memory_order_relaxed);
+        while (!head_.compare_exchange_weak(
+            n->next, n, std::memory_order_release, std::memory_order_relaxed
+        )) {
+        }
+        if (!n->next)
+            head_.notify_one();
+    }
+
+    static void free_list(node *n) {
+        while (n) {
+            node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    void run() {
+#ifndef _WIN32
+        // A child that exits without reading must not take this process
+        // down with SIGPIPE; writev() reports EPIPE instead.
+        sigset_t pipe_signal;
+        sigemptyset(&pipe_signal);
+        sigaddset(&pipe_signal, SIGPIPE);
+        ::pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+#endif
+
+        std::vector<node *> batch;
+        bool done = false;
+        try {
+            while (!done && !stopping_) {
+                node *taken = head_.exchange(nullptr, std::memory_order_acquire);
+                if (!taken) {
+                    head_.wait(nullptr, std::memory_order_acquire);
+                    continue;
+                }
+
+                // The stack holds the newest buffer first.
+                batch.clear();
+                for (node *n = taken; n; n = n->next)
+                    batch.push_back(n);
+                std::reverse(batch.begin(), batch.end());
+
+                uint64_t bytes = 0;
+                size_t count   = 0;
+                for (; count < batch.size() && !batch[count]->last; ++count)
+                    bytes += batch[count]->data.size();
+                done = count < batch.size();
+
+                bool written = write_batch(batch.data(), count);
+                free_list(taken);
+                if (!written)
+                    break;
+
+                pending_.fetch_sub(bytes, std::memory_order_release);
+                pending_.notify_all();
+            }
+        } catch (...) {
+            error_ = std::current_exception();
+            failed_.store(true, std::memory_order_release);
+        }
+
+        // However the loop ended, nothing more will be written. Producers
+        // parked on pending_ only wake when it changes, so clear it.
+        if (!failed_.load() && pending_.load(std::memory_order_acquire) != 0)
+            abandoned_.store(true, std::memory_order_release);
+        stopped_.store(true, std::memory_order_release);
+        pending_.store(0, std::memory_order_release);
+        pending_.notify_all();
+    }
+
+    // Writes the buffers in order. Returns false if stop() interrupted it.
+    bool write_batch(node *const *nodes, size_t count) {
+#ifdef _WIN32
+        std::string joined;
+        for (size_t i = 0; i < count; ++i)
+            joined += nodes[i]->data;
+        native::write_all(handle_, joined.data(), joined.size());
+        if (counters_)
+            counters_->record(joined.size());
+        return true;
+#else
+        std::vector<iovec> iov(count);
+        for (size_t i = 0; i < count; ++i)
+            iov[i] = {nodes[i]->data.data(), nodes[i]->data.size()};
+
+        size_t first = 0;
+        while (first < iov.size()) {
+            int n_iov = static_cast<int>(
+                std::min<size_t>(iov.size() - first, IOV_MAX)
+            );
+            ssize_t n = ::writev(handle_, iov.data() + first, n_iov);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    throw std::runtime_error(
+                        "write to pipe failed: " + native::last_error()
+                    );
+                if (!wait_writable())
+                    return false;
+                continue;
+            }
+
+            size_t left = static_cast<size_t>(n);
+            if (counters_)
+                counters_->record(left);
+            while (left > 0) {
+                if (left >= iov[first].iov_len) {
+                    left -= iov[first].iov_len;
+                    ++first;
+                } else {
+                    iov[first].iov_base =
+                        static_cast<char *>(iov[first].iov_base) + left;
+                    iov[first].iov_len -= left;
+                    left = 0;
+                }
+            }
+        }
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    // Blocks until the pipe has room. Returns false when stop() interrupted
+    // the wait.
+    bool wait_writable() {
+        pollfd fds[2] = {
+            {handle_, POLLOUT, 0},
+            {wake_read_.get(), POLLIN, 0},
+        };
+        while (true) {
+            int rc = ::poll(fds, 2, -1);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0)
+                throw std::runtime_error("poll failed: " + native::last_error());
+            return !fds[1].revents;
+        }
+    }
+#endif
+};
+
+} // namespace proc
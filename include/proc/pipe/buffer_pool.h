@@ -0,0 +1,199 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace proc {
+
+inline constexpr size_t default_read_buffer_size = 64 * 1024;
+
+// A fixed-size chunk allocated from a memory resource, usually a
+// buffer_pool. Given back to the resource when destroyed, so with a pool
+// behind it a long-running reader costs one allocation in total.
+class pooled_buffer {
+    char *data_                          = nullptr;
+    size_t size_                         = 0;
+    std::pmr::memory_resource *resource_ = nullptr;
+
+  public:
+    pooled_buffer() = default;
+
+    pooled_buffer(std::pmr::memory_resource &resource, size_t size)
+        : data_(static_cast<char *>(resource.allocate(size))), size_(size),
+          resource_(&resource) {}
+
+    pooled_buffer(pooled_buffer &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)),
+          resource_(std::exchange(other.resource_, nullptr)) {}
+
+    pooled_buffer &operator=(pooled_buffer &&other) noexcept {
+        if (this != &other) {
+            release();
+            data_     = std::exchange(other.data_, nullptr);
+            size_     = std::exchange(other.size_, 0);
+            resource_ = std::exchange(other.resource_, nullptr);
+        }
+        return *this;
+    }
+
+    ~pooled_buffer() { release(); }
+
+    char *data() noexcept { return data_; }
+    const char *data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return !data_; }
+    std::pmr::memory_resource *resource() const noexcept { return resource_; }
+
+    std::string_view view(size_t length) const noexcept {
+        return std::string_view(data_, length);
+    }
+
+    void release() noexcept {
+        if (data_ && resource_)
+            resource_->deallocate(data_, size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+};
+
+// Keeps freed blocks and hands them out again instead of going back to the
+// heap. Requests are rounded up to a power-of-two size class between 1 KiB
+// and 4 MiB; larger blocks, such as a line_reader buffer grown for one huge
+// line, bypass the pool entirely, and the pool never holds more than
+// `max_cached_bytes` in total. As a std::pmr::memory_resource it can back
+// anything that takes one: the shared pool is what pipes, their streams
+// and the I/O engines allocate from unless told otherwise (see
+// process_options::with_memory_resource), so the buffers of one finished
+// child are reused by the next.
+class buffer_pool : public std::pmr::memory_resource {
+    static constexpr int min_class_shift = 10; // 1 KiB
+    static constexpr int max_class_shift = 22; // 4 MiB
+    static constexpr size_t class_count =
+        max_class_shift - min_class_shift + 1;
+
+    std::mutex mutex_;
+    std::array<std::vector<void *>, class_count> free_;
+    size_t cached_bytes_ = 0;
+    size_t max_cached_per_size_;
+    size_t max_cached_bytes_;
+    std::pmr::memory_resource *upstream_;
+
+  public:
+    // Blocks come from `upstream`. At most `max_cached_per_size` of each
+    // size class and `max_cached_bytes` altogether are kept; the rest go
+    // back.
+    explicit buffer_pool(
+        size_t max_cached_per_size           = 64,
+        std::pmr::memory_resource *upstream = std::pmr::new_delete_resource(),
+        size_t max_cached_bytes              = 32 * 1024 * 1024
+    )
+        : max_cached_per_size_(max_cached_per_size),
+          max_cached_bytes_(max_cached_bytes), upstream_(upstream) {}
+
+    buffer_pool(const buffer_pool &)            = delete;
+    buffer_pool &operator=(const buffer_pool &) = delete;
+
+    ~buffer_pool() override {
+        for (size_t i = 0; i < class_count; ++i) {
+            for (void *p : free_[i])
+                upstream_->deallocate(p, class_size(i), alignment);
+        }
+    }
+
+    // Never destroyed, so pipes that outlive main() (in other statics) can
+    // still give their buffers back.
+    static buffer_pool &shared() {
+        static buffer_pool *pool = new buffer_pool;
+        return *pool;
+    }
+
+    pooled_buffer acquire(size_t size = default_read_buffer_size) {
+        return pooled_buffer(*this, size);
+    }
+
+    size_t cached() {
+        std::lock_guard lock(mutex_);
+        size_t total = 0;
+        for (auto &f : free_)
+            total += f.size();
+        return total;
+    }
+
+    size_t cached_bytes() {
+        std::lock_guard lock(mutex_);
+        return cached_bytes_;
+    }
+
+  private:
+    static constexpr size_t alignment = alignof(std::max_align_t);
+
+    static constexpr size_t class_size(size_t index) {
+        return size_t(1) << (index + min_class_shift);
+    }
+
+    // The size class for `bytes`, or class_count if it is too large to
+    // pool.
+    static size_t class_of(size_t bytes) {
+        if (bytes > class_size(class_count - 1))
+            return class_count;
+        int shift = bytes > 1 ? std::bit_width(bytes - 1) : 0;
+        return static_cast<size_t>(std::max(shift, min_class_shift)) -
+               min_class_shift;
+    }
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        size_t index = class_of(bytes);
+        if (align > alignment || index == class_count)
+            return upstream_->allocate(bytes, align);
+
+        {
+            std::lock_guard lock(mutex_);
+            auto &f = free_[index];
+            if (!f.empty()) {
+                void *p = f.back();
+                f.pop_back();
+                cached_bytes_ -= class_size(index);
+                return p;
+            }
+        }
+        return upstream_->allocate(class_size(index), alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+        size_t index = class_of(bytes);
+        if (align > alignment || index == class_count) {
+            upstream_->deallocate(p, bytes, align);
+            return;
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            auto &f = free_[index];
+            if (f.size() < max_cached_per_size_ &&
+                cached_bytes_ + class_size(index) <= max_cached_bytes_) {
+                try {
+                    f.push_back(p);
+                    cached_bytes_ += class_size(index);
+                    return;
+                } catch (...) {
+                }
+            }
+        }
+        upstream_->deallocate(p, class_size(index), alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other
+    ) const noexcept override {
+        return this == &other;
+    }
+};
+
+} // namespace proc
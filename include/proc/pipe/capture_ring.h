@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace proc {
+
+// A snapshot of captured output: the first bytes of the stream, the most
+// recent ones, and how many were dropped in between.
+struct captured_output {
+    std::string head;
+    std::string tail;
+    uint64_t total_bytes = 0;
+
+    uint64_t omitted_bytes() const noexcept {
+        return total_bytes - head.size() - tail.size();
+    }
+
+    std::string str() const { return head + tail; }
+};
+
+// Retains the first `head` and the last `tail` bytes of a stream in two
+// fixed buffers allocated up front, so memory stays capped however much the
+// child writes. There is a single writer (the pipe's reader, which never
+// delivers chunks concurrently) and any number of readers, none of which
+// take a lock: readers validate what they copied against the writer's
+// progress counters, seqlock style, and trim bytes that were overwritten
+// under them.
+class capture_ring {
+    size_t head_cap_;
+    size_t tail_cap_;
+    std::unique_ptr<char[]> head_;
+    std::unique_ptr<char[]> tail_;
+
+    // Stream offsets: everything below committed_ is fully written; the
+    // writer may be touching ring slots for offsets up to reserved_.
+    std::atomic<uint64_t> committed_ = 0;
+    std::atomic<uint64_t> reserved_  = 0;
+
+  public:
+    capture_ring(size_t head, size_t tail)
+        : head_cap_(head), tail_cap_(tail),
+          head_(head ? new char[head] : nullptr),
+          tail_(tail ? new char[tail] : nullptr) {}
+
+    capture_ring(const capture_ring &)            = delete;
+    capture_ring &operator=(const capture_ring &) = delete;
+
+    size_t head_capacity() const noexcept { return head_cap_; }
+    size_t tail_capacity() const noexcept { return tail_cap_; }
+
+    uint64_t total_bytes() const noexcept {
+        return committed_.load(std::memory_order_acquire);
+    }
+
+    // Single writer only.
+    void append(std::string_view data) {
+        uint64_t pos = committed_.load(std::memory_order_relaxed);
+
+        if (pos < head_cap_) {
+            size_t n = std::min<uint64_t>(data.size(), head_cap_ - pos);
+            std::memcpy(head_.get() + pos, data.data(), n);
+            data.remove_prefix(n);
+            pos += n;
+        }
+
+        uint64_t end = pos + data.size();
+        if (tail_cap_ == 0 || data.empty()) {
+            committed_.store(end, std::memory_order_release);
+            return;
+        }
+
+        // Only the last tail_cap_ bytes of a large chunk can survive.
+        if (data.size() > tail_cap_) {
+            data.remove_prefix(data.size() - tail_cap_);
+            pos = end - tail_cap_;
+        }
+
+        reserved_.store(end, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        size_t slot  = static_cast<size_t>((pos - head_cap_) % tail_cap_);
+        size_t first = std::min(data.size(), tail_cap_ - slot);
+        std::memcpy(tail_.get() + slot, data.data(), first);
+        std::memcpy(tail_.get(), data.data() + first, data.size() - first);
+
+        committed_.store(end, std::memory_order_release);
+    }
+
+    // Safe to call from any thread while the writer is running.
+    captured_output snapshot() const {
+        captured_output out;
+        uint64_t end    = committed_.load(std::memory_order_acquire);
+        out.total_bytes = end;
+
+        // The head is written once and never changes afterwards.
+        out.head.assign(head_.get(), std::min<uint64_t>(end, head_cap_));
+        if (end <= head_cap_ || tail_cap_ == 0)
+            return out;
+
+        uint64_t begin = std::max<uint64_t>(head_cap_, end - std::min<uint64_t>(
+            end - head_cap_, tail_cap_
+        ));
+        std::string tail(static_cast<size_t>(end - begin), '\0');
+        size_t slot  = static_cast<size_t>((begin - head_cap_) % tail_cap_);
+        size_t first = std::min(tail.size(), tail_cap_ - slot);
+        std::memcpy(tail.data(), tail_.get() + slot, first);
+        std::memcpy(tail.data() + first, tail_.get(), tail.size() - first);
+
+        // Anything below reserved - tail_cap_ may have been overwritten
+        // while it was being copied.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t reserved = reserved_.load(std::memory_order_relaxed);
+        if (reserved > begin + tail_cap_) {
+            uint64_t lost = std::min<uint64_t>(
+                reserved - tail_cap_ - begin, tail.size()
+            );
+            tail.erase(0, static_cast<size_t>(lost));
+        }
+
+        out.tail = std::move(tail);
+        return out;
+    }
+};
+
+} // namespace proc
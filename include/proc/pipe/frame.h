@@ -0,0 +1,160 @@
+#pragma once
+#include "../stats.h"
+#include "line_reader.h"
+#include "native_io.h"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <poll.h>
+#include <sys/uio.h>
+#endif
+
+namespace proc {
+
+// Frames are a varint (unsigned LEB128) byte length followed by that many
+// bytes. A length takes at most this many bytes.
+inline constexpr size_t max_varint_size = 10;
+
+// Largest frame recv_frame() accepts by default; anything longer is taken
+// for a corrupt stream rather than allocated.
+inline constexpr size_t default_max_frame_size = 256 * 1024 * 1024;
+
+// Encodes `value` into `out`, which needs max_varint_size bytes of room.
+// Returns the number of bytes used.
+inline size_t put_varint(uint64_t value, char *out) noexcept {
+    size_t n = 0;
+    do {
+        char byte = static_cast<char>(value & 0x7f);
+        value >>= 7;
+        if (value)
+            byte |= static_cast<char>(0x80);
+        out[n++] = byte;
+    } while (value);
+    return n;
+}
+
+// Decodes a varint from the front of `data`: sets `value` and returns the
+// number of bytes it took, or 0 if `data` ends before the varint does.
+// Throws on a varint longer than 64 bits.
+inline size_t get_varint(std::string_view data, uint64_t &value) {
+    value = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i == max_varint_size)
+            throw std::runtime_error("Frame length is not a valid varint.");
+
+        auto byte = static_cast<unsigned char>(data[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+// Writes `payloads` as consecutive frames. On POSIX the length prefixes
+// and the payloads go out together through writev(), so a batch of frames
+// costs one syscall (per IOV_MAX buffers) and the payloads are not copied.
+inline void write_frames(
+    native_handle_t h, std::span<const std::string_view> payloads,
+    io_counters *counters = nullptr
+) {
+    std::vector<char> prefixes(payloads.size() * max_varint_size);
+#ifdef _WIN32
+    std::string joined;
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        char *prefix = prefixes.data() + i * max_varint_size;
+        joined.append(prefix, put_varint(payloads[i].size(), prefix));
+        joined.append(payloads[i]);
+    }
+    native::write_all(h, joined.data(), joined.size());
+    if (counters)
+        counters->record(joined.size());
+#else
+    std::vector<iovec> iov;
+    iov.reserve(payloads.size() * 2);
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        char *prefix = prefixes.data() + i * max_varint_size;
+        iov.push_back({prefix, put_varint(payloads[i].size(), prefix)});
+        if (!payloads[i].empty())
+            iov.push_back({const_cast<char *>(payloads[i].data()),
+                           payloads[i].size()});
+    }
+
+    native::sigpipe_guard guard;
+    size_t first = 0;
+    while (first < iov.size()) {
+        int n_iov =
+            static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t n = ::writev(h, iov.data() + first, n_iov);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                pollfd fd{h, POLLOUT, 0};
+                ::poll(&fd, 1, -1);
+                continue;
+            }
+            if (errno == EPIPE)
+                guard.discard();
+            throw std::runtime_error(
+                "write to pipe failed: " + native::last_error()
+            );
+        }
+
+        size_t left = static_cast<size_t>(n);
+        if (counters)
+            counters->record(left);
+        while (left > 0) {
+            if (left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                ++first;
+            } else {
+                iov[first].iov_base =
+                    static_cast<char *>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+                left = 0;
+            }
+        }
+    }
+#endif
+}
+
+// Reads the next frame through `reader`'s read-ahead buffer. The payload
+// is returned as a view into that buffer, valid until the next read, so
+// receiving allocates nothing once the buffer has grown to the largest
+// frame; a single read often brings in several frames at once. Returns
+// nullopt at EOF on a frame boundary and throws if the stream ends inside
+// a frame.
+inline std::optional<std::string_view>
+read_frame(line_reader &reader, size_t max_size = default_max_frame_size) {
+    uint64_t size = 0;
+    size_t prefix = 0;
+    while (!(prefix = get_varint(reader.buffered_view(), size))) {
+        if (!reader.ensure(reader.buffered() + 1)) {
+            if (reader.buffered() == 0)
+                return std::nullopt;
+            throw std::runtime_error("Pipe closed in the middle of a frame.");
+        }
+    }
+
+    if (size > max_size)
+        throw std::runtime_error(
+            "Frame of " + std::to_string(size) + " bytes exceeds the limit."
+        );
+    if (!reader.ensure(prefix + size))
+        throw std::runtime_error("Pipe closed in the middle of a frame.");
+
+    std::string_view frame = reader.buffered_view().substr(prefix, size);
+    reader.consume(prefix + size);
+    return frame;
+}
+
+} // namespace proc
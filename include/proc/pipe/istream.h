@@ -1,22 +1,31 @@
 #pragma once
-#include <io/streambuf.h>
+#include "streambuf.h"
 #include <istream>
 
 namespace proc {
 
 class pipe_istream : public std::istream {
-    io::h_streambuf buf_;
+    pipe_streambuf buf_;
 
   public:
-    pipe_istream() : std::istream(nullptr), buf_(nullptr) {}
+    pipe_istream() : std::istream(nullptr), buf_(invalid_native_handle) {}
 
-    explicit pipe_istream(const win_handle &handle)
-        : pipe_istream(handle.get()) {}
+    explicit pipe_istream(const handle &h) : pipe_istream(h.get()) {}
 
-    explicit pipe_istream(HANDLE h) : std::istream(nullptr), buf_(h) {
+    explicit pipe_istream(
+        native_handle_t h, size_t buffer_size = default_stream_buffer_size,
+        std::pmr::memory_resource *resource = nullptr
+    )
+        : std::istream(nullptr), buf_(h, buffer_size, resource) {
         rdbuf(&buf_);
     }
 
+    // Size of the read-ahead buffer used from the next refill on.
+    pipe_istream &buffered(size_t buffer_size) {
+        buf_.set_buffer_size(buffer_size);
+        return *this;
+    }
+
     pipe_istream(pipe_istream &&other) noexcept
         : std::istream(nullptr), buf_(std::move(other.buf_)) {
         rdbuf(&buf_);
@@ -0,0 +1,194 @@
+#pragma once
+#include "../stats.h"
+#include "buffer_pool.h"
+#include "native_io.h"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace proc {
+
+// Splits a pipe into lines through a read-ahead buffer. Each refill is one
+// read of up to the buffer size and newlines are located with memchr, so a
+// chatty child costs one syscall per buffer rather than one per byte.
+class line_reader {
+    native_handle_t h_ = invalid_native_handle;
+    pooled_buffer buf_;
+    size_t begin_ = 0;
+    size_t end_   = 0;
+    // Bytes after begin_ already known to hold no '\n'.
+    size_t scanned_        = 0;
+    bool eof_              = false;
+    io_counters *counters_ = nullptr;
+
+  public:
+    line_reader() = default;
+
+    // Reads are recorded in `counters` when given. The buffer comes from
+    // `resource`, by default the shared buffer_pool.
+    explicit line_reader(
+        native_handle_t h, size_t buffer_size = default_read_buffer_size,
+        io_counters *counters                = nullptr,
+        std::pmr::memory_resource *resource = nullptr
+    )
+        : h_(h),
+          buf_(resource ? *resource : buffer_pool::shared(),
+               buffer_size ? buffer_size : 1),
+          counters_(counters) {}
+
+    native_handle_t native_handle() const noexcept { return h_; }
+
+    bool eof() const noexcept { return eof_ && begin_ == end_; }
+
+    size_t buffered() const noexcept { return end_ - begin_; }
+
+    // Next line without its '\n', or nullopt once the pipe is drained. The
+    // view points into the internal buffer and is invalidated by the next
+    // call on this reader.
+    std::optional<std::string_view> next() {
+        while (true) {
+            if (auto line = next_buffered())
+                return line;
+            if (eof_ || !fill())
+                return next_buffered();
+        }
+    }
+
+    // Non-blocking half of next(): returns a complete line if one is
+    // already buffered (or the unterminated tail once EOF was seen), without
+    // touching the pipe. Used by callers that do their own reads, together
+    // with prepare()/commit()/mark_eof().
+    std::optional<std::string_view> next_buffered() {
+        const char *start = buf_.data() + begin_;
+        const char *nl    = static_cast<const char *>(
+            std::memchr(start + scanned_, '\n', end_ - begin_ - scanned_)
+        );
+
+        if (nl) {
+            std::string_view line(start, static_cast<size_t>(nl - start));
+            begin_ += line.size() + 1;
+            scanned_ = 0;
+            return line;
+        }
+
+        scanned_ = end_ - begin_;
+        if (!eof_ || begin_ == end_)
+            return std::nullopt;
+
+        std::string_view line(start, end_ - begin_);
+        begin_   = end_;
+        scanned_ = 0;
+        return line;
+    }
+
+    // Free space to read into, after compacting or growing the buffer.
+    char *prepare(size_t &size) {
+        if (begin_ > 0) {
+            std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+
+        if (end_ == buf_.size()) {
+            auto *resource = buf_.resource() ? buf_.resource()
+                                             : &buffer_pool::shared();
+            pooled_buffer bigger(*resource, std::max<size_t>(end_ * 2, 1));
+            std::memcpy(bigger.data(), buf_.data(), end_);
+            buf_ = std::move(bigger);
+        }
+
+        size = buf_.size() - end_;
+        return buf_.data() + end_;
+    }
+
+    void commit(size_t n) noexcept {
+        end_ += n;
+        if (counters_)
+            counters_->record(n);
+    }
+
+    void mark_eof() noexcept { eof_ = true; }
+
+    // Owned copy of the next line; empty at EOF.
+    std::string read_line() {
+        auto line = next();
+        return line ? std::string(*line) : std::string();
+    }
+
+    // Calls `handler` for every remaining line until EOF. Returns the number
+    // of lines delivered.
+    template <typename Handler> size_t for_each(Handler &&handler) {
+        size_t count = 0;
+        while (auto line = next()) {
+            handler(*line);
+            ++count;
+        }
+        return count;
+    }
+
+    // Copies up to `max_bytes` of already buffered data into `out`, so raw
+    // reads after line reads don't lose anything.
+    size_t take_buffered(char *out, size_t max_bytes) {
+        size_t n = std::min(max_bytes, end_ - begin_);
+        std::memcpy(out, buf_.data() + begin_, n);
+        begin_ += n;
+        scanned_ = 0;
+        return n;
+    }
+
+    // The bytes read ahead but not consumed yet. Invalidated by the next
+    // call that reads from the pipe.
+    std::string_view buffered_view() const noexcept {
+        return std::string_view(buf_.data() + begin_, end_ - begin_);
+    }
+
+    // Drops the first `n` buffered bytes.
+    void consume(size_t n) noexcept {
+        begin_ += std::min(n, end_ - begin_);
+        scanned_ = 0;
+    }
+
+    // Reads until at least `size` bytes are buffered, growing the buffer if
+    // it is smaller. Returns false if EOF arrives first.
+    bool ensure(size_t size) {
+        while (end_ - begin_ < size) {
+            if (eof_ || !fill())
+                return false;
+        }
+        return true;
+    }
+
+    // Fills `out` with exactly `size` bytes, refilling from the pipe as
+    // needed. Returns false if EOF arrives first.
+    bool read_exact(char *out, size_t size) {
+        while (size > 0) {
+            if (begin_ == end_ && (eof_ || !fill()))
+                return false;
+
+            size_t n = take_buffered(out, size);
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+  private:
+    // Reads more data, compacting or growing the buffer as needed. Returns
+    // false on EOF.
+    bool fill() {
+        size_t size;
+        char *area = prepare(size);
+        size_t n   = native::read_some(h_, area, size);
+        if (n == 0) {
+            eof_ = true;
+            return false;
+        }
+
+        commit(n);
+        return true;
+    }
+};
+
+} // namespace proc
@@ -0,0 +1,131 @@
+#pragma once
+#include "../handle.h"
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <winapi/utils.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+namespace proc::native {
+
+inline std::string last_error() {
+#ifdef _WIN32
+    return winapi::get_last_error();
+#else
+    return std::strerror(errno);
+#endif
+}
+
+#ifndef _WIN32
+// Blocks SIGPIPE on the calling thread while it lives, so writing to a pipe
+// whose reader has exited fails with EPIPE instead of killing the process.
+// After such a failure, discard() takes the signal the write raised off the
+// thread before the old mask comes back. A no-op if SIGPIPE was blocked
+// already.
+class sigpipe_guard {
+    sigset_t pipe_signal_;
+    sigset_t old_;
+    bool blocked_;
+
+  public:
+    sigpipe_guard() noexcept {
+        sigemptyset(&pipe_signal_);
+        sigaddset(&pipe_signal_, SIGPIPE);
+        ::pthread_sigmask(SIG_BLOCK, &pipe_signal_, &old_);
+        blocked_ = !sigismember(&old_, SIGPIPE);
+    }
+
+    sigpipe_guard(const sigpipe_guard &)            = delete;
+    sigpipe_guard &operator=(const sigpipe_guard &) = delete;
+
+    ~sigpipe_guard() {
+        if (blocked_)
+            ::pthread_sigmask(SIG_SETMASK, &old_, nullptr);
+    }
+
+    void discard() noexcept {
+        if (!blocked_)
+            return;
+        int error = errno;
+        timespec now{0, 0};
+        while (::sigtimedwait(&pipe_signal_, nullptr, &now) < 0 &&
+               errno == EINTR) {
+        }
+        errno = error;
+    }
+};
+#endif
+
+// Reads at most `size` bytes. Returns 0 once the write end is closed.
+inline size_t read_some(native_handle_t h, char *data, size_t size) {
+#ifdef _WIN32
+    DWORD bytes_read = 0;
+    if (!::ReadFile(h, data, static_cast<DWORD>(size), &bytes_read, nullptr)) {
+        if (GetLastError() == ERROR_BROKEN_PIPE) {
+            return 0;
+        }
+        throw std::runtime_error("ReadFile from pipe failed: " + last_error());
+    }
+    return bytes_read;
+#else
+    while (true) {
+        ssize_t n = ::read(h, data, size);
+        if (n >= 0)
+            return static_cast<size_t>(n);
+        if (errno == EINTR)
+            continue;
+        // What a pty master reads once the last slave descriptor is closed.
+        if (errno == EIO)
+            return 0;
+        // Someone else made the descriptor O_NONBLOCK, as an async_writer
+        // does to the write side of a pty master, which is the same file.
+        if (errno == EAGAIN) {
+            pollfd fd{h, POLLIN, 0};
+            ::poll(&fd, 1, -1);
+            continue;
+        }
+        throw std::runtime_error("read from pipe failed: " + last_error());
+    }
+#endif
+}
+
+inline void write_all(native_handle_t h, const char *data, size_t size) {
+#ifdef _WIN32
+    DWORD bytes_written = 0;
+    if (!::WriteFile(
+            h, data, static_cast<DWORD>(size), &bytes_written, nullptr
+        )) {
+        throw std::runtime_error("WriteFile failed: " + last_error());
+    }
+#else
+    sigpipe_guard guard;
+    while (size > 0) {
+        ssize_t n = ::write(h, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                pollfd fd{h, POLLOUT, 0};
+                ::poll(&fd, 1, -1);
+                continue;
+            }
+            if (errno == EPIPE)
+                guard.discard();
+            throw std::runtime_error("write to pipe failed: " + last_error());
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+#endif
+}
+
+} // namespace proc::native
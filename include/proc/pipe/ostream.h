@@ -1,47 +1,95 @@
 #pragma once
-#include <io/streambuf.h>
+#include "streambuf.h"
 #include <ostream>
 
 namespace proc {
 
+// By default every insertion is flushed straight to the pipe, so a child
+// waiting on a prompt sees it immediately. buffered() trades that for one
+// write per buffer (or per `flush_threshold` bytes), which is what bulk
+// streaming of many small fields wants.
 class pipe_ostream : public std::ostream {
-    io::h_streambuf buf_;
+    pipe_streambuf buf_;
+    bool flush_each_        = true;
+    size_t flush_threshold_ = 0;
 
   public:
-    pipe_ostream() : std::ostream(nullptr), buf_(nullptr) {}
+    pipe_ostream() : std::ostream(nullptr), buf_(invalid_native_handle) {}
 
-    explicit pipe_ostream(const win_handle &handle)
-        : pipe_ostream(handle.get()) {}
+    explicit pipe_ostream(const handle &h) : pipe_ostream(h.get()) {}
 
-    explicit pipe_ostream(HANDLE h) : std::ostream(nullptr), buf_(h) {
+    // The buffer comes from `resource`, by default the shared buffer_pool.
+    explicit pipe_ostream(
+        native_handle_t h, std::pmr::memory_resource *resource = nullptr
+    )
+        : std::ostream(nullptr),
+          buf_(h, default_stream_buffer_size, resource) {
         rdbuf(&buf_);
     }
 
     pipe_ostream(pipe_ostream &&other) noexcept
-        : std::ostream(nullptr), buf_(std::move(other.buf_)) {
+        : std::ostream(nullptr), buf_(std::move(other.buf_)),
+          flush_each_(other.flush_each_),
+          flush_threshold_(other.flush_threshold_) {
         rdbuf(&buf_);
     }
 
     pipe_ostream &operator=(pipe_ostream &&other) noexcept {
         if (this != &other) {
-            buf_ = std::move(other.buf_);
+            buf_             = std::move(other.buf_);
+            flush_each_      = other.flush_each_;
+            flush_threshold_ = other.flush_threshold_;
             this->rdbuf(&buf_);
         }
 
         return *this;
     }
 
+    // Stops flushing after every insertion. Output collects in a
+    // `buffer_size` buffer and goes out when it fills, on flush() /
+    // std::flush / std::endl, or as soon as `flush_threshold` bytes are
+    // pending (0: only when full).
+    pipe_ostream &buffered(
+        size_t buffer_size     = default_stream_buffer_size,
+        size_t flush_threshold = 0
+    ) {
+        buf_.set_buffer_size(buffer_size);
+        flush_each_      = false;
+        flush_threshold_ = flush_threshold;
+        return *this;
+    }
+
+    // Back to flushing every insertion.
+    pipe_ostream &unbuffered() {
+        this->flush();
+        flush_each_      = true;
+        flush_threshold_ = 0;
+        return *this;
+    }
+
+    bool is_buffered() const noexcept { return !flush_each_; }
+
+    // Bytes inserted but not yet written to the pipe.
+    size_t pending() const noexcept { return buf_.pending(); }
+
     pipe_ostream &operator<<(const std::string &value) {
         static_cast<std::ostream &>(*this) << value;
-        this->flush();
+        after_insert();
         return *this;
     }
 
     template <typename T> pipe_ostream &operator<<(const T &val) {
         static_cast<std::ostream &>(*this) << val;
-        this->flush();
+        after_insert();
         return *this;
     }
+
+  private:
+    void after_insert() {
+        if (flush_each_ ||
+            (flush_threshold_ && buf_.pending() >= flush_threshold_))
+            this->flush();
+    }
 };
 
-} // namespace proc
\ No newline at end of file
+} // namespace proc
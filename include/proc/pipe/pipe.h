@@ -2,32 +2,90 @@
 #include "istream.h"
 #include "ostream.h"
 #include "stream.h"
+#include "../async.h"
+#include "../handle.h"
+#include "../io_engine.h"
+#include "../stats.h"
+#include "buffer_pool.h"
+#include "capture_ring.h"
+#include "frame.h"
+#include "line_reader.h"
+#include "native_io.h"
 #include <atomic>
+#include <chrono>
 #include <fcntl.h>
 #include <fstream>
-#include <io.h>
-#include <io/stream.h>
+#include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
 #include <stdexcept>
 #include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#include <io/stream.h>
 #include <winapi/debugger.h>
 #include <winapi/handle.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 namespace proc {
 
 class pipe {
-    win_handle read_;
-    win_handle write_;
+    handle read_;
+    handle write_;
     pipe_ostream write_stream_;
     pipe_istream read_stream_;
 
-    std::optional<std::thread> async_read_thread_;
-    std::atomic<bool> async_read_running_ = false;
-    proc_handler async_read_handler_;
+    // Everything the pump thread started by begin_read() touches. It lives
+    // on the heap, so moving the pipe leaves the running pump's state in
+    // place and end_read() on the new owner still reaches it.
+    struct async_read_state {
+        native_handle_t fd;
+        proc_handler handler;
+        size_t buffer_size;
+        std::chrono::microseconds batch_window;
+        size_t batch_bytes;
+        std::pmr::memory_resource *resource;
+        std::atomic<bool> running = true;
+#ifndef _WIN32
+        // Written to by end_read() to wake the pump out of poll().
+        handle wake_read;
+        handle wake_write;
+#endif
+        std::thread thread;
+    };
+
+    std::unique_ptr<async_read_state> async_read_;
+    std::optional<line_reader> lines_;
+    std::chrono::microseconds batch_window_{0};
+    size_t batch_bytes_ = 0;
+    // Shared with the reading thread, which may outlive a move of the pipe.
+    std::shared_ptr<capture_ring> capture_;
+    std::shared_ptr<pipe_counters> counters_;
+    // Where buffers and counters are allocated; null for the shared
+    // buffer_pool.
+    std::pmr::memory_resource *resource_ = nullptr;
+#ifdef __linux__
+    io_engine *engine_                 = nullptr;
+    io_engine::watch_id engine_watch_ = 0;
+#endif
 
   public:
-    static pipe
-    create(bool inheritable_read = true, bool inheritable_write = false) {
+    // On POSIX both ends are always O_CLOEXEC; the spawn path dup2's the
+    // child's end into place, so the inheritable_* flags only matter on
+    // Windows. The pipe's buffers and bookkeeping come from `resource`, by
+    // default the shared buffer_pool, so pipes that come and go with
+    // short-lived children recycle each other's memory.
+    static pipe create(
+        bool inheritable_read = true, bool inheritable_write = false,
+        std::pmr::memory_resource *resource = nullptr
+    ) {
+#ifdef _WIN32
         SECURITY_ATTRIBUTES sa{};
         sa.nLength              = sizeof(SECURITY_ATTRIBUTES);
         sa.bInheritHandle       = TRUE;
@@ -46,124 +104,369 @@ class pipe {
         if (!inheritable_write)
             SetHandleInformation(write_handle, HANDLE_FLAG_INHERIT, 0);
 
-        return pipe(read_handle, write_handle);
+        return pipe(read_handle, write_handle, resource);
+#else
+        (void)inheritable_read;
+        (void)inheritable_write;
+
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) != 0) {
+            throw std::runtime_error("pipe2 failed: " + native::last_error());
+        }
+
+        return pipe(fds[0], fds[1], resource);
+#endif
     }
 
     pipe() = default;
 
-    pipe(HANDLE read, HANDLE write)
-        : read_(read), write_(write), read_stream_(read_),
-          write_stream_(write_) {}
+    pipe(
+        native_handle_t read, native_handle_t write,
+        std::pmr::memory_resource *resource = nullptr
+    )
+        : read_(read), write_(write), write_stream_(write, resource),
+          read_stream_(read, default_stream_buffer_size, resource),
+          counters_(std::allocate_shared<pipe_counters>(
+              std::pmr::polymorphic_allocator<pipe_counters>(
+                  resource ? resource : &buffer_pool::shared()
+              )
+          )),
+          resource_(resource) {}
 
     pipe(const pipe &)            = delete;
     pipe &operator=(const pipe &) = delete;
 
     pipe(pipe &&other) noexcept
         : read_(std::move(other.read_)), write_(std::move(other.write_)),
-          read_stream_(std::move(other.read_stream_)),
           write_stream_(std::move(other.write_stream_)),
-          async_read_thread_(std::move(other.async_read_thread_)),
-          async_read_running_(other.async_read_running_.load()) {}
+          read_stream_(std::move(other.read_stream_)),
+          async_read_(std::move(other.async_read_)),
+          lines_(std::move(other.lines_)), batch_window_(other.batch_window_),
+          batch_bytes_(other.batch_bytes_),
+          capture_(std::move(other.capture_)),
+          counters_(std::move(other.counters_)), resource_(other.resource_) {
+#ifdef __linux__
+        engine_       = std::exchange(other.engine_, nullptr);
+        engine_watch_ = std::exchange(other.engine_watch_, 0);
+#endif
+    }
 
     pipe &operator=(pipe &&other) noexcept {
         if (this != &other) {
+            // Our own pump reads the handle about to be replaced.
+            stop_async_read();
             read_               = std::move(other.read_);
             write_              = std::move(other.write_);
             read_stream_        = std::move(other.read_stream_);
             write_stream_       = std::move(other.write_stream_);
-            async_read_thread_  = std::move(other.async_read_thread_);
-            async_read_running_ = other.async_read_running_.load();
+            async_read_         = std::move(other.async_read_);
+            lines_              = std::move(other.lines_);
+            batch_window_       = other.batch_window_;
+            batch_bytes_        = other.batch_bytes_;
+            capture_            = std::move(other.capture_);
+            counters_           = std::move(other.counters_);
+            resource_           = other.resource_;
+#ifdef __linux__
+            engine_       = std::exchange(other.engine_, nullptr);
+            engine_watch_ = std::exchange(other.engine_watch_, 0);
+#endif
         }
         return *this;
     }
 
     void write(const std::string &data) {
-        DWORD bytes_written = 0;
-        if (!::WriteFile(
-                write_.get(), data.data(), static_cast<DWORD>(data.size()),
-                &bytes_written, nullptr
-            )) {
-            throw std::runtime_error(
-                "WriteFile failed: " + winapi::get_last_error()
-            );
-        }
+        native::write_all(write_.get(), data.data(), data.size());
+        if (counters_)
+            counters_->written.record(data.size());
     }
 
     void write_line(const std::string &line) { write(line + "\n"); }
 
     void flush() {
+#ifdef _WIN32
         if (!FlushFileBuffers(write_.get())) {
             throw std::runtime_error(
                 "FlushFileBuffers failed: " + winapi::get_last_error()
             );
         }
+#endif
     }
 
     std::string read(size_t max_bytes = 4096) {
         std::string buffer(max_bytes, '\0');
-        DWORD bytes_read = 0;
-        if (!::ReadFile(
-                read_.get(), buffer.data(), static_cast<DWORD>(max_bytes),
-                &bytes_read, nullptr
-            )) {
-            if (GetLastError() == ERROR_BROKEN_PIPE) {
-                return "";
-            }
-            throw std::runtime_error(
-                "ReadFile from pipe failed: " + winapi::get_last_error()
-            );
+        if (lines_ && lines_->buffered()) {
+            buffer.resize(lines_->take_buffered(buffer.data(), max_bytes));
+            return buffer;
         }
-        buffer.resize(bytes_read);
+        buffer.resize(native::read_some(read_.get(), buffer.data(), max_bytes));
+        if (counters_)
+            counters_->read.record(buffer.size());
         return buffer;
     }
 
-    std::string read_line() {
-        std::string line;
-        char ch;
-        DWORD bytes_read;
-        while (true) {
-            if (!::ReadFile(read_.get(), &ch, 1, &bytes_read, nullptr) ||
-                bytes_read == 0) {
-                break;
-            }
-            if (ch == '\n')
-                break;
-            line += ch;
+    std::string read_line() { return line_source().read_line(); }
+
+    // Next line as a view into the pipe's read-ahead buffer, or nullopt at
+    // EOF. Valid until the next read from this pipe.
+    std::optional<std::string_view> read_line_view() {
+        return line_source().next();
+    }
+
+    // Reads exactly `size` bytes through the read-ahead buffer. Returns false
+    // if the write end closes first.
+    bool read_exact(char *out, size_t size) {
+        return line_source().read_exact(out, size);
+    }
+
+    // Sends `payload` as one length-prefixed frame (see frame.h), prefix
+    // and payload in a single write.
+    void send_frame(std::string_view payload) {
+        send_frames(std::span<const std::string_view>(&payload, 1));
+    }
+
+    // Sends several frames with as few syscalls as the platform allows, for
+    // streams of small messages.
+    void send_frames(std::span<const std::string_view> payloads) {
+        write_frames(
+            write_.get(), payloads, counters_ ? &counters_->written : nullptr
+        );
+    }
+
+    // Next frame as a view into the pipe's read-ahead buffer, or nullopt at
+    // EOF between frames. Valid until the next read from this pipe. Throws if
+    // the pipe closes mid-frame or a frame is longer than `max_size`.
+    std::optional<std::string_view>
+    recv_frame(size_t max_size = default_max_frame_size) {
+        return read_frame(line_source(), max_size);
+    }
+
+    // Delivers every remaining line (without '\n') to `handler` until the
+    // write end is closed. Returns the number of lines delivered.
+    size_t for_each_line(const proc_handler &handler) {
+        return line_source().for_each(handler);
+    }
+
+    // Keeps the first `head` and last `tail` bytes of everything read
+    // asynchronously from now on (see begin_read()) in fixed buffers, so
+    // memory use stays capped however much the child writes.
+    void enable_capture(size_t head, size_t tail) {
+        if (is_reading())
+            throw std::runtime_error("Async read already running.");
+        capture_ = std::make_shared<capture_ring>(head, tail);
+    }
+
+    bool is_capturing() const noexcept { return capture_ != nullptr; }
+
+    // Bytes and chunks that went through read(), the line functions, the
+    // async readers and the coroutine API (not the std streams).
+    pipe_stats read_stats() const noexcept {
+        return counters_ ? counters_->read.snapshot() : pipe_stats{};
+    }
+
+    // Likewise for write(), async_write() and an async_writer handed
+    // counters().
+    pipe_stats write_stats() const noexcept {
+        return counters_ ? counters_->written.snapshot() : pipe_stats{};
+    }
+
+    pipe_counters *counters() const noexcept { return counters_.get(); }
+
+    // What the capture holds right now. Safe to call while the read is
+    // running.
+    captured_output captured() const {
+        if (!capture_)
+            throw std::runtime_error("Output capture is not enabled.");
+        return capture_->snapshot();
+    }
+
+    // Starts a pump thread that reads into a single pooled buffer of
+    // `buffer_size` bytes and hands each chunk to `handler` as a view into
+    // it. The view is only valid for the duration of the call. The pump does
+    // not read again until the handler returns, so a slow handler lets the
+    // OS pipe fill up and stalls the child instead of queueing copies.
+    //
+    // With a capture enabled the handler is optional; each chunk is recorded
+    // before it is handed on.
+    void begin_read(
+        proc_handler handler, size_t buffer_size = default_read_buffer_size
+    ) {
+        if (is_reading())
+            throw std::runtime_error("Async read already running.");
+        handler = wrap_handler(std::move(handler));
+        if (!handler)
+            throw std::runtime_error("No read handler was supplied.");
+
+        stop_async_read();
+
+        auto state = std::make_unique<async_read_state>();
+        state->fd           = read_.get();
+        state->handler      = std::move(handler);
+        state->buffer_size  = buffer_size ? buffer_size : 1;
+        state->batch_window = batch_window_;
+        state->batch_bytes  = batch_bytes_;
+        state->resource     = resource_;
+#ifndef _WIN32
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+            throw std::runtime_error("pipe2 failed: " + native::last_error());
         }
-        return line;
+        state->wake_read.reset(fds[0]);
+        state->wake_write.reset(fds[1]);
+#endif
+
+        state->thread =
+            std::thread([s = state.get()]() { async_read_loop(*s); });
+        async_read_   = std::move(state);
     }
 
-    void begin_read(proc_handler handler) {
-        if (async_read_running_)
+    // Makes the pump started by the next begin_read() batch its reads: after
+    // data arrives it keeps reading for up to `window`, or until
+    // `max_bytes` (0: the buffer size) have collected, and hands the handler
+    // everything in one call. Output that trickles in many small writes,
+    // such as a terminal's, then reaches the handler in fewer, larger
+    // chunks at the cost of up to `window` of latency. No effect on Windows
+    // or with an I/O engine.
+    void set_read_batching(std::chrono::microseconds window, size_t max_bytes) {
+        batch_window_ = window;
+        batch_bytes_  = max_bytes;
+    }
+
+#ifdef __linux__
+    // Hands the read end to a shared I/O engine (a reactor or a
+    // uring_engine) instead of starting a pump thread. Chunks are delivered
+    // the same way, from the engine's threads.
+    void begin_read(proc_handler handler, io_engine &engine) {
+        if (is_reading())
             throw std::runtime_error("Async read already running.");
 
-        async_read_handler_ = std::move(handler);
-        async_read_running_ = true;
-        async_read_thread_.emplace([this]() {});
+        handler = wrap_handler(std::move(handler));
+        if (!handler)
+            throw std::runtime_error("No read handler was supplied.");
+
+        stop_async_read();
+
+        engine_watch_ = engine.watch(read_.get(), std::move(handler));
+        engine_       = &engine;
     }
+#endif
 
+    // Stops the pump after delivering whatever the child has already
+    // written.
     void end_read() { stop_async_read(); }
 
+    bool is_reading() const {
+#ifdef __linux__
+        if (engine_)
+            return engine_->watching(engine_watch_);
+#endif
+        return async_read_ && async_read_->running;
+    }
+
+#ifdef __linux__
+    // Coroutine counterparts of read(), read_line() and write(). They suspend
+    // on executor::current() instead of blocking, so one thread can drive
+    // many children. The first call switches that end of the pipe to
+    // O_NONBLOCK, after which the blocking calls should not be mixed in.
+    task<size_t> async_read(std::span<char> buffer) {
+        native_handle_t fd = read_.get();
+        set_nonblocking(fd);
+
+        if (lines_ && lines_->buffered())
+            co_return lines_->take_buffered(buffer.data(), buffer.size());
+
+        while (true) {
+            ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n >= 0) {
+                if (counters_)
+                    counters_->read.record(static_cast<size_t>(n));
+                co_return static_cast<size_t>(n);
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EIO) // a pty whose child side has closed
+                co_return 0;
+            if (errno != EAGAIN)
+                throw std::runtime_error(
+                    "read failed: " + native::last_error()
+                );
+            co_await executor::current().readable(fd);
+        }
+    }
+
+    // Next line without its '\n', or nullopt at EOF.
+    task<std::optional<std::string>> async_read_line() {
+        line_reader &lines = line_source();
+        set_nonblocking(read_.get());
+
+        while (true) {
+            if (auto line = lines.next_buffered())
+                co_return std::string(*line);
+            if (lines.eof())
+                co_return std::nullopt;
+
+            size_t size;
+            char *area = lines.prepare(size);
+            ssize_t n  = ::read(read_.get(), area, size);
+            if (n > 0) {
+                lines.commit(static_cast<size_t>(n));
+            } else if (n == 0 || errno == EIO) {
+                lines.mark_eof();
+            } else if (errno == EAGAIN) {
+                co_await executor::current().readable(read_.get());
+            } else if (errno != EINTR) {
+                throw std::runtime_error(
+                    "read failed: " + native::last_error()
+                );
+            }
+        }
+    }
+
+    task<void> async_write(std::string_view data) {
+        native_handle_t fd = write_.get();
+        set_nonblocking(fd);
+
+        while (!data.empty()) {
+            ssize_t n = ::write(fd, data.data(), data.size());
+            if (n >= 0) {
+                data.remove_prefix(static_cast<size_t>(n));
+                if (counters_)
+                    counters_->written.record(static_cast<size_t>(n));
+            } else if (errno == EAGAIN) {
+                co_await executor::current().writable(fd);
+            } else if (errno != EINTR) {
+                throw std::runtime_error(
+                    "write failed: " + native::last_error()
+                );
+            }
+        }
+    }
+#endif
+
     pipe_ostream &write_stream() { return write_stream_; }
     pipe_istream &read_stream() { return read_stream_; }
 
-    win_handle &read_end() { return read_; }
-    win_handle &write_end() { return write_; }
+    handle &read_end() { return read_; }
+    handle &write_end() { return write_; }
 
-    const win_handle &read_end() const { return read_; }
-    const win_handle &write_end() const { return write_; }
+    const handle &read_end() const { return read_; }
+    const handle &write_end() const { return write_; }
 
-    HANDLE read_handle() const { return read_.get(); }
-    HANDLE write_handle() const { return write_.get(); }
+    native_handle_t read_handle() const { return read_.get(); }
+    native_handle_t write_handle() const { return write_.get(); }
 
     void close_read() { read_.reset(); }
-    void close_write() { write_.release(); }
+    void close_write() {
+        if (write_stream_.pending())
+            write_stream_.flush();
+        write_.reset();
+    }
 
     ~pipe() { stop_async_read(); }
 
+    // Flushes per write_stream()'s policy: after every insertion unless
+    // write_stream().buffered() was called.
     template <typename T> pipe &operator<<(const T &val) {
         write_stream_ << val;
-        write_stream_.flush();
         return *this;
     }
 
@@ -173,29 +476,205 @@ class pipe {
     }
 
   private:
-    void async_read_loop() {
-        constexpr size_t buffer_size = 4096;
-        char buffer[buffer_size];
-        DWORD bytes_read = 0;
-
-        while (async_read_running_) {
-            if (!ReadFile(
-                    read_.get(), buffer, buffer_size - 1, &bytes_read, nullptr
-                ) ||
-                bytes_read == 0) {
+#ifdef __linux__
+    static void set_nonblocking(native_handle_t fd) {
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags >= 0 && !(flags & O_NONBLOCK))
+            ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+#endif
+
+    // Counts and captures each chunk before `handler` sees it. Null if
+    // there is neither a handler nor a capture.
+    proc_handler wrap_handler(proc_handler handler) const {
+        if (!handler && !capture_)
+            return nullptr;
+        return [counters = counters_, ring = capture_,
+                handler = std::move(handler)](std::string_view data) {
+            if (counters)
+                counters->read.record(data.size());
+            if (ring)
+                ring->append(data);
+            if (handler)
+                handler(data);
+        };
+    }
+
+    line_reader &line_source() {
+        if (!lines_ || lines_->native_handle() != read_.get())
+            lines_.emplace(
+                read_.get(), default_read_buffer_size,
+                counters_ ? &counters_->read : nullptr, resource_
+            );
+        return *lines_;
+    }
+
+    static void async_read_loop(async_read_state &state) {
+        pooled_buffer buffer(
+            state.resource ? *state.resource : buffer_pool::shared(),
+            std::max(state.buffer_size, state.batch_bytes)
+        );
+
+        try {
+            bool eof = false;
+            while (state.running && !eof) {
+                if (!wait_readable(state))
+                    break;
+
+                size_t bytes_read = native::read_some(
+                    state.fd, buffer.data(), buffer.size()
+                );
+                if (bytes_read == 0)
+                    break;
+
+                bytes_read = read_batch(state, buffer, bytes_read, eof);
+                state.handler(buffer.view(bytes_read));
+            }
+
+            // Asked to stop: hand over what is already buffered in the pipe.
+            while (drain_available(state.fd)) {
+                size_t bytes_read = native::read_some(
+                    state.fd, buffer.data(), buffer.size()
+                );
+                if (bytes_read == 0)
+                    break;
+
+                state.handler(buffer.view(bytes_read));
+            }
+        } catch (const std::exception &) {
+            // The pipe broke or the read was cancelled; nothing to report to.
+        }
+
+        state.running = false;
+    }
+
+    // Tops up a chunk of `used` bytes per set_read_batching(). Returns the
+    // new size, and sets `eof` if the write end closed meanwhile.
+    static size_t read_batch(
+        async_read_state &state, pooled_buffer &buffer, size_t used, bool &eof
+    ) {
+#ifdef _WIN32
+        return used;
+#else
+        if (state.batch_window.count() <= 0)
+            return used;
+
+        size_t limit = state.batch_bytes
+                           ? std::min(state.batch_bytes, buffer.size())
+                           : buffer.size();
+        auto deadline = std::chrono::steady_clock::now() + state.batch_window;
+        while (used < limit) {
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= left.zero())
+                break;
+
+            pollfd fds[2] = {
+                {state.fd, POLLIN, 0},
+                {state.wake_read.get(), POLLIN, 0},
+            };
+#ifdef __linux__
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left)
+                          .count();
+            timespec timeout{
+                static_cast<time_t>(ns / 1000000000),
+                static_cast<long>(ns % 1000000000)
+            };
+            int rc = ::ppoll(fds, 2, &timeout, nullptr);
+#else
+            int rc = ::poll(
+                fds, 2,
+                static_cast<int>(
+                    std::chrono::ceil<std::chrono::milliseconds>(left).count()
+                )
+            );
+#endif
+            if (rc < 0 && errno == EINTR)
+                continue;
+            // Out of time, or end_read() wants the pump back.
+            if (rc <= 0 || !fds[0].revents || fds[1].revents)
+                break;
+
+            size_t n = native::read_some(
+                state.fd, buffer.data() + used, limit - used
+            );
+            if (n == 0) {
+                eof = true;
                 break;
             }
-            buffer[bytes_read] = '\0';
-            async_read_handler_(std::string(buffer, bytes_read));
+            used += n;
+        }
+        return used;
+#endif
+    }
+
+    // Blocks until the read end has data (or EOF). Returns false when
+    // end_read() interrupted the wait.
+    static bool wait_readable(async_read_state &state) {
+#ifdef _WIN32
+        (void)state;
+        return true;
+#else
+        pollfd fds[2] = {
+            {state.fd, POLLIN, 0},
+            {state.wake_read.get(), POLLIN, 0},
+        };
+
+        while (true) {
+            int rc = ::poll(fds, 2, -1);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0)
+                throw std::runtime_error("poll failed: " + native::last_error());
+            if (fds[0].revents)
+                return true;
+            return false;
         }
+#endif
+    }
+
+    // True while the read end has data available without blocking.
+    static bool drain_available(native_handle_t fd) {
+        if (fd == invalid_native_handle)
+            return false;
+#ifdef _WIN32
+        DWORD available = 0;
+        return ::PeekNamedPipe(
+                   fd, nullptr, 0, nullptr, &available, nullptr
+               ) &&
+               available > 0;
+#else
+        pollfd pfd{fd, POLLIN, 0};
+        int rc;
+        do {
+            rc = ::poll(&pfd, 1, 0);
+        } while (rc < 0 && errno == EINTR);
+        return rc > 0 && (pfd.revents & POLLIN);
+#endif
     }
 
     void stop_async_read() {
-        async_read_running_ = false;
-        if (async_read_thread_ && async_read_thread_->joinable()) {
-            async_read_thread_->join();
+#ifdef __linux__
+        if (engine_) {
+            engine_->unwatch(engine_watch_);
+            engine_       = nullptr;
+            engine_watch_ = 0;
+        }
+#endif
+        if (!async_read_)
+            return;
+
+        async_read_state &state = *async_read_;
+        state.running           = false;
+        if (state.thread.joinable()) {
+#ifdef _WIN32
+            ::CancelSynchronousIo(state.thread.native_handle());
+#else
+            char signal = 1;
+            (void)::write(state.wake_write.get(), &signal, 1);
+#endif
+            state.thread.join();
         }
-        async_read_thread_.reset();
+        async_read_.reset();
     }
 };
 
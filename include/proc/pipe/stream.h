@@ -1,23 +1,33 @@
 #pragma once
-#include <io/streambuf.h>
+#include "streambuf.h"
 #include <iostream>
 
 namespace proc {
 
+// Reads from one handle and writes to another through a single streambuf,
+// so both `>>` and `<<` work on the same stream. Output is buffered; flush
+// it (or use std::endl) before waiting for a reply.
 class pipe_stream : public std::iostream {
-    io::h_streambuf read_buf_;
-    io::h_streambuf write_buf_;
+    pipe_streambuf buf_;
 
   public:
     explicit pipe_stream(
-        const win_handle &read_handle, const win_handle &write_handle
+        const handle &read_handle, const handle &write_handle,
+        size_t buffer_size                  = default_stream_buffer_size,
+        std::pmr::memory_resource *resource = nullptr
     )
-        : std::iostream(nullptr), read_buf_(read_handle.get()),
-          write_buf_(write_handle.get()) {
-        rdbuf(&read_buf_);
+        : std::iostream(nullptr),
+          buf_(read_handle.get(), write_handle.get(), buffer_size, resource) {
+        rdbuf(&buf_);
     }
 
-    std::streambuf *outbuf() { return &write_buf_; }
+    pipe_stream(const pipe_stream &)            = delete;
+    pipe_stream &operator=(const pipe_stream &) = delete;
+
+    std::streambuf *outbuf() { return &buf_; }
+
+    // Bytes written but not yet handed to the pipe.
+    size_t pending() const noexcept { return buf_.pending(); }
 };
 
-} // namespace proc
\ No newline at end of file
+} // namespace proc
@@ -0,0 +1,157 @@
+#pragma once
+#include "buffer_pool.h"
+#include "native_io.h"
+#include <algorithm>
+#include <memory_resource>
+#include <streambuf>
+
+namespace proc {
+
+inline constexpr size_t default_stream_buffer_size = 64 * 1024;
+
+// A streambuf over a pipe handle (or a read and a write handle, for
+// pipe_stream). Each area is allocated on first use, so an unused direction
+// costs nothing, and comes from a memory resource (by default the shared
+// buffer_pool), so a stream's areas are reused by the next one.
+class pipe_streambuf : public std::streambuf {
+    native_handle_t in_  = invalid_native_handle;
+    native_handle_t out_ = invalid_native_handle;
+    size_t buffer_size_  = default_stream_buffer_size;
+    std::pmr::memory_resource *resource_ = &buffer_pool::shared();
+    pooled_buffer get_area_;
+    pooled_buffer put_area_;
+
+  public:
+    explicit pipe_streambuf(
+        native_handle_t h                   = invalid_native_handle,
+        size_t buffer_size                  = default_stream_buffer_size,
+        std::pmr::memory_resource *resource = nullptr
+    )
+        : pipe_streambuf(h, h, buffer_size, resource) {}
+
+    pipe_streambuf(
+        native_handle_t in, native_handle_t out,
+        size_t buffer_size                  = default_stream_buffer_size,
+        std::pmr::memory_resource *resource = nullptr
+    )
+        : in_(in), out_(out), buffer_size_(buffer_size ? buffer_size : 1),
+          resource_(resource ? resource : &buffer_pool::shared()) {}
+
+    pipe_streambuf(pipe_streambuf &&other) noexcept { *this = std::move(other); }
+
+    pipe_streambuf &operator=(pipe_streambuf &&other) noexcept {
+        if (this != &other) {
+            // Don't drop what was written to the handle we are replacing.
+            try {
+                flush_put_area();
+            } catch (...) {
+            }
+
+            in_          = other.in_;
+            out_         = other.out_;
+            buffer_size_ = other.buffer_size_;
+            resource_    = other.resource_;
+            auto g_next  = other.gptr() - other.eback();
+            auto g_end   = other.egptr() - other.eback();
+            auto p_next  = other.pptr() - other.pbase();
+            get_area_    = std::move(other.get_area_);
+            put_area_    = std::move(other.put_area_);
+            char *g      = get_area_.data();
+            char *p      = put_area_.data();
+            setg(g, g + g_next, g + g_end);
+            setp(p, p + put_area_.size());
+            pbump(static_cast<int>(p_next));
+            other.in_  = invalid_native_handle;
+            other.out_ = invalid_native_handle;
+            other.setg(nullptr, nullptr, nullptr);
+            other.setp(nullptr, nullptr);
+        }
+        return *this;
+    }
+
+    ~pipe_streambuf() override {
+        try {
+            flush_put_area();
+        } catch (...) {
+        }
+    }
+
+    size_t buffer_size() const noexcept { return buffer_size_; }
+
+    // Takes effect for each area the next time it is refilled or emptied;
+    // anything already written is flushed first.
+    void set_buffer_size(size_t bytes) {
+        flush_put_area();
+        buffer_size_ = bytes ? bytes : 1;
+        put_area_.release();
+        setp(nullptr, nullptr);
+    }
+
+    // Bytes written but not yet handed to the pipe.
+    size_t pending() const noexcept {
+        return static_cast<size_t>(pptr() - pbase());
+    }
+
+  protected:
+    int_type underflow() override {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        if (get_area_.size() != buffer_size_)
+            get_area_ = pooled_buffer(*resource_, buffer_size_);
+
+        size_t n = native::read_some(in_, get_area_.data(), get_area_.size());
+        if (n == 0)
+            return traits_type::eof();
+
+        setg(get_area_.data(), get_area_.data(), get_area_.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type ch) override {
+        if (put_area_.empty()) {
+            put_area_ = pooled_buffer(*resource_, buffer_size_);
+            setp(put_area_.data(), put_area_.data() + put_area_.size());
+        } else {
+            flush_put_area();
+        }
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    // Writes larger than the buffer go straight to the pipe instead of
+    // being copied through it in pieces.
+    std::streamsize xsputn(const char *s, std::streamsize count) override {
+        size_t n = static_cast<size_t>(count);
+        if (n < buffer_size_)
+            return std::streambuf::xsputn(s, count);
+
+        flush_put_area();
+        native::write_all(out_, s, n);
+        return count;
+    }
+
+    int sync() override {
+        try {
+            flush_put_area();
+        } catch (...) {
+            return -1;
+        }
+        return 0;
+    }
+
+  private:
+    void flush_put_area() {
+        if (!pbase() || pptr() == pbase())
+            return;
+
+        native::write_all(out_, pbase(), pending());
+        setp(put_area_.data(), put_area_.data() + put_area_.size());
+    }
+};
+
+} // namespace proc
@@ -0,0 +1,218 @@
+#pragma once
+#include "../handle.h"
+#ifdef __linux__
+#include "buffer_pool.h"
+#include "native_io.h"
+#include <algorithm>
+#include <csignal>
+#include <exception>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#endif
+
+namespace proc {
+
+// Where a tee_pump sends its copy: a handler, or (when there is none) a
+// file, pipe or socket handle owned by the caller.
+struct pipe_tap {
+    proc_handler handler;
+    native_handle_t handle = invalid_native_handle;
+};
+
+#ifdef __linux__
+// Forwards everything written into the pipe `upstream` to `downstream`
+// (another pipe) with splice(), after tee()ing a copy of each chunk to a
+// tap. The forwarded stream never enters user space; neither does the copy
+// when the tap is a file, pipe or socket. Only a handler tap sees the bytes,
+// through a pooled buffer.
+//
+// The pump runs on its own thread until the upstream writer closes or the
+// downstream reader goes away, then closes both of its ends so the
+// neighbours see EOF / EPIPE just as they would with a direct pipe.
+class tee_pump {
+    std::thread thread_;
+    std::exception_ptr error_;
+
+  public:
+    tee_pump(handle upstream, handle downstream, pipe_tap target) {
+        thread_ = std::thread(
+            [this, upstream = std::move(upstream),
+             downstream = std::move(downstream),
+             target     = std::move(target)]() mutable {
+                // A reader that exits early must not take this process down
+                // with SIGPIPE; splice() reports EPIPE instead.
+                sigset_t pipe_signal;
+                sigemptyset(&pipe_signal);
+                sigaddset(&pipe_signal, SIGPIPE);
+                ::pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+
+                try {
+                    run(upstream, downstream, target);
+                } catch (...) {
+                    error_ = std::current_exception();
+                }
+            }
+        );
+    }
+
+    tee_pump(const tee_pump &)            = delete;
+    tee_pump &operator=(const tee_pump &) = delete;
+
+    ~tee_pump() {
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    // Waits for the pump to finish and rethrows an exception thrown by the
+    // tap handler (or a setup failure), once.
+    void join() {
+        if (thread_.joinable())
+            thread_.join();
+        if (error_)
+            std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+  private:
+    static void run(handle &upstream, handle &downstream, pipe_tap &target) {
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) != 0)
+            throw std::runtime_error("pipe2 failed: " + native::last_error());
+        handle tap_read(fds[0]);
+        handle tap_write(fds[1]);
+
+        pooled_buffer buffer =
+            buffer_pool::shared().acquire(default_read_buffer_size);
+
+        std::exception_ptr handler_error;
+        bool tapping = true;
+        while (true) {
+            ssize_t n = ::tee(
+                upstream.get(), tap_write.get(), default_read_buffer_size, 0
+            );
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+
+            size_t size = static_cast<size_t>(n);
+            if (tapping) {
+                try {
+                    tapping = deliver(tap_read, size, target, buffer);
+                } catch (...) {
+                    handler_error = std::current_exception();
+                    tapping       = false;
+                }
+            } else {
+                discard(tap_read, size, buffer);
+            }
+
+            if (!forward(upstream, downstream, size))
+                break;
+        }
+
+        upstream.reset();
+        downstream.reset();
+
+        if (handler_error)
+            std::rethrow_exception(handler_error);
+    }
+
+    // Moves exactly `size` bytes out of the tap pipe into the tap. Returns
+    // false (after discarding the rest) once the tap can't take more.
+    static bool deliver(
+        handle &tap_read, size_t size, pipe_tap &target, pooled_buffer &buffer
+    ) {
+        while (size > 0) {
+            ssize_t n;
+            if (!target.handler) {
+                n = ::splice(
+                    tap_read.get(), nullptr, target.handle, nullptr, size,
+                    SPLICE_F_MOVE
+                );
+                if (n < 0 && errno == EINVAL) {
+                    // e.g. an O_APPEND file, which splice() refuses.
+                    return copy(tap_read, size, target.handle, buffer);
+                }
+            } else {
+                n = ::read(
+                    tap_read.get(), buffer.data(),
+                    std::min(size, buffer.size())
+                );
+            }
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                discard(tap_read, size, buffer);
+                return false;
+            }
+
+            size -= static_cast<size_t>(n);
+            if (target.handler) {
+                try {
+                    target.handler(buffer.view(static_cast<size_t>(n)));
+                } catch (...) {
+                    discard(tap_read, size, buffer);
+                    throw;
+                }
+            }
+        }
+        return true;
+    }
+
+    static bool copy(
+        handle &tap_read, size_t size, native_handle_t out,
+        pooled_buffer &buffer
+    ) {
+        while (size > 0) {
+            size_t n = native::read_some(
+                tap_read.get(), buffer.data(), std::min(size, buffer.size())
+            );
+            if (n == 0)
+                return false;
+            try {
+                native::write_all(out, buffer.data(), n);
+            } catch (...) {
+                discard(tap_read, size - n, buffer);
+                return false;
+            }
+            size -= n;
+        }
+        return true;
+    }
+
+    static void discard(handle &tap_read, size_t size, pooled_buffer &buffer) {
+        while (size > 0) {
+            size_t n = native::read_some(
+                tap_read.get(), buffer.data(), std::min(size, buffer.size())
+            );
+            if (n == 0)
+                return;
+            size -= n;
+        }
+    }
+
+    // Splices `size` bytes downstream. Returns false once the downstream
+    // reader has gone away.
+    static bool forward(handle &upstream, handle &downstream, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::splice(
+                upstream.get(), nullptr, downstream.get(), nullptr, size,
+                SPLICE_F_MOVE
+            );
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+#endif
+
+} // namespace proc
@@ -0,0 +1,232 @@
+#pragma once
+#include "pipe/tee_pump.h"
+#include "process.h"
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace proc {
+
+// Runs processes connected stdout-to-stdin, like `gen | compress | upload`.
+// Adjacent stages share one OS pipe, so data flows from child to child
+// without passing through this process. The first stage's stdin and the
+// last stage's stdout/stderr keep whatever redirection their options ask
+// for; stage(0).standard_in() and stage(size() - 1).standard_out() work as
+// usual.
+//
+// A tap between two stages lets the parent observe the stream on its way
+// through (Linux only). The link is then split in two around a tee_pump:
+// the main stream never enters user space, only the observer's copy does,
+// and a tap into a file or socket never enters it at all.
+class pipeline {
+    struct stage_entry {
+        process_options opts;
+        std::optional<pipe_tap> tap;
+    };
+
+    std::vector<stage_entry> pending_;
+    std::vector<process> stages_;
+#ifdef __linux__
+    std::vector<std::unique_ptr<tee_pump>> taps_;
+#endif
+    bool pipefail_ = true;
+    bool started_  = false;
+
+  public:
+    pipeline() = default;
+
+    pipeline(const pipeline &)            = delete;
+    pipeline &operator=(const pipeline &) = delete;
+
+
+    // Appends a stage reading the previous stage's stdout.
+    pipeline &then(process_options opts) {
+        if (started_)
+            throw std::runtime_error("Pipeline already started.");
+        pending_.push_back({std::move(opts), std::nullopt});
+        return *this;
+    }
+
+#ifdef __linux__
+    // Delivers a view of everything the most recently added stage writes to
+    // `handler`, from a pump thread, while the data continues on to the next
+    // stage. A slow handler throttles the pipeline. start() refuses a tap
+    // on the last stage.
+    pipeline &tap(proc_handler handler) {
+        if (!handler)
+            throw std::runtime_error("No tap handler was supplied.");
+        last_for_tap().tap = pipe_tap{std::move(handler)};
+        return *this;
+    }
+
+    // Copies the most recently added stage's output into `h` (a file, pipe
+    // or socket) as it passes through, entirely inside the kernel. The
+    // caller keeps ownership of `h` and must keep it open until wait()
+    // returns.
+    pipeline &tap_to(native_handle_t h) {
+        last_for_tap().tap = pipe_tap{nullptr, h};
+        return *this;
+    }
+#endif
+
+    // With pipefail (the default) wait() reports the rightmost stage that
+    // failed; without it, only the last stage's status counts, as in a
+    // plain shell pipeline.
+    pipeline &pipefail(bool enable = true) {
+        pipefail_ = enable;
+        return *this;
+    }
+
+    size_t size() const noexcept {
+        return started_ ? stages_.size() : pending_.size();
+    }
+
+    process &stage(size_t index) { return stages_.at(index); }
+
+    // Starts every stage, left to right. If a stage fails to start, the ones
+    // already running are killed and the error is rethrown.
+    void start() {
+        if (started_)
+            throw std::runtime_error("Pipeline already started.");
+        if (pending_.empty())
+            throw std::runtime_error("Pipeline has no stages.");
+        // A tap sits on the link to the next stage, and the last has none.
+        if (pending_.back().tap)
+            throw std::runtime_error(
+                "The last stage cannot be tapped; use redirect_stdout() or "
+                "tee_stdout_to_file() on its options instead."
+            );
+
+        stages_.reserve(pending_.size());
+        try {
+            pipe incoming;
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                auto &entry = pending_[i];
+                bool last   = i + 1 == pending_.size();
+
+                if (incoming.read_end())
+                    entry.opts.with_stdin_handle(incoming.read_handle());
+
+                pipe outgoing;
+                pipe tapped;
+                if (!last) {
+                    outgoing = pipe::create(true, true);
+                    if (entry.tap) {
+                        // The stage writes into `tapped`; the pump moves it
+                        // on into `outgoing`.
+                        tapped = pipe::create(true, true);
+                        entry.opts.with_stdout_handle(tapped.write_handle());
+                    } else {
+                        entry.opts.with_stdout_handle(outgoing.write_handle());
+                    }
+                }
+
+                stages_.emplace_back(entry.opts);
+                stages_.back().start();
+
+                // Our copies of the child's ends would hold off EOF.
+                incoming.close_read();
+                if (last)
+                    break;
+
+                if (entry.tap) {
+                    tapped.close_write();
+                    start_tap(
+                        std::move(tapped), std::move(outgoing.write_end()),
+                        std::move(*entry.tap)
+                    );
+                } else {
+                    outgoing.close_write();
+                }
+                incoming = std::move(outgoing);
+            }
+        } catch (...) {
+            for (auto &p : stages_) {
+                p.kill();
+                p.wait();
+            }
+#ifdef __linux__
+            taps_.clear();
+#endif
+            stages_.clear();
+            throw;
+        }
+
+        pending_.clear();
+        started_ = true;
+    }
+
+    // Waits for every stage and returns the pipeline's exit code (see
+    // pipefail()). Rethrows an exception thrown by a tap handler.
+    exit_code_t wait() {
+        for (auto &p : stages_)
+            p.wait();
+#ifdef __linux__
+        std::exception_ptr error;
+        for (auto &tap : taps_) {
+            try {
+                tap->join();
+            } catch (...) {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+#endif
+
+        auto failed = failed_stage();
+        if (failed)
+            return stages_[*failed].exit_code();
+        return stages_.empty() ? 0 : stages_.back().exit_code();
+    }
+
+    // Exit codes of all stages, in order. Only meaningful after wait().
+    std::vector<exit_code_t> exit_codes() const {
+        std::vector<exit_code_t> codes;
+        codes.reserve(stages_.size());
+        for (auto &p : stages_)
+            codes.push_back(p.exit_code());
+        return codes;
+    }
+
+    // The stage wait() reports: the rightmost one with a non-zero exit code
+    // under pipefail, otherwise the last stage if it failed.
+    std::optional<size_t> failed_stage() const {
+        if (stages_.empty())
+            return std::nullopt;
+        if (!pipefail_) {
+            if (stages_.back().exit_code() != 0)
+                return stages_.size() - 1;
+            return std::nullopt;
+        }
+        for (size_t i = stages_.size(); i-- > 0;) {
+            if (stages_[i].exit_code() != 0)
+                return i;
+        }
+        return std::nullopt;
+    }
+
+  private:
+    stage_entry &last_for_tap() {
+        if (started_)
+            throw std::runtime_error("Pipeline already started.");
+        if (pending_.empty())
+            throw std::runtime_error("Add a stage before tapping it.");
+        return pending_.back();
+    }
+
+    void start_tap(pipe upstream, handle downstream, pipe_tap target) {
+#ifdef __linux__
+        taps_.push_back(std::make_unique<tee_pump>(
+            std::move(upstream.read_end()), std::move(downstream),
+            std::move(target)
+        ));
+#else
+        throw std::runtime_error("Pipeline taps are only supported on Linux.");
+#endif
+    }
+};
+
+} // namespace proc
@@ -0,0 +1,316 @@
+#pragma once
+#ifdef __linux__
+#include "../handle.h"
+#include "../pipe/native_io.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace proc {
+
+// Limits for a child's cgroup (cgroup v2). Unset fields keep whatever the
+// parent cgroup allows.
+struct resource_limits {
+    // CPUs' worth of time, e.g. 0.5 or 2 (cpu.max).
+    std::optional<double> cpu_max;
+    // Bytes (memory.max). The kernel OOM-kills the group beyond this.
+    std::optional<uint64_t> memory_max;
+    // Processes and threads (pids.max), which stops fork bombs.
+    std::optional<uint64_t> pids_max;
+    // Proportional I/O share, 1-10000, default 100 (io.weight).
+    std::optional<uint32_t> io_weight;
+};
+
+namespace posix {
+
+// What a cgroup consumed, read back once the child has been reaped.
+struct cgroup_usage {
+    // memory.peak; 0 on kernels without it (before 5.19).
+    uint64_t memory_peak = 0;
+    std::chrono::microseconds cpu_usage{0};
+    std::chrono::microseconds cpu_user{0};
+    std::chrono::microseconds cpu_system{0};
+    // Periods in which cpu.max throttled the group, and for how long.
+    uint64_t nr_throttled = 0;
+    std::chrono::microseconds throttled{0};
+    // memory.events: times the group hit memory.max and was OOM-killed.
+    uint64_t oom_kills = 0;
+};
+
+// A cgroup v2 directory, open as a descriptor that clone3() can start a
+// child in (CLONE_INTO_CGROUP), so the child is limited from its first
+// instruction. Created by create(); the directory is removed again when the
+// last reference goes away, killing anything still running in it.
+class cgroup {
+    std::string path_;
+    handle dir_;
+
+  public:
+    cgroup(const cgroup &)            = delete;
+    cgroup &operator=(const cgroup &) = delete;
+
+    ~cgroup() { remove(); }
+
+    // Creates a new leaf under `parent` (by default the cgroup this process
+    // runs in) and applies `limits`. The controllers the limits need are
+    // enabled in the parent's cgroup.subtree_control, which the kernel only
+    // allows if the parent holds no processes itself (the root excepted);
+    // point `parent` at a delegated, otherwise empty cgroup (e.g. a systemd
+    // Delegate= slice). The default only works for limits that need no
+    // controller enabled or when running in the root cgroup, and throws
+    // before creating anything otherwise.
+    static std::shared_ptr<cgroup>
+    create(const resource_limits &limits, std::string parent = {}) {
+        if (parent.empty())
+            parent = current();
+
+        enable_controllers(parent, limits);
+
+        static std::atomic<uint64_t> counter = 0;
+        std::string path = parent + "/proc-" + std::to_string(::getpid()) +
+                           "-" + std::to_string(++counter);
+        if (::mkdir(path.c_str(), 0755) != 0)
+            throw error("Cannot create cgroup " + path);
+
+        std::shared_ptr<cgroup> group(new cgroup(path));
+        group->dir_.reset(
+            ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+        );
+        if (!group->dir_.valid())
+            throw error("Cannot open cgroup " + path);
+
+        group->apply(limits);
+        return group;
+    }
+
+    // The unified hierarchy's mount point, from /proc/self/mountinfo.
+    static std::string mount_point() {
+        std::ifstream mountinfo("/proc/self/mountinfo");
+        std::string line;
+        while (std::getline(mountinfo, line)) {
+            // ... mount-point options - fstype source options
+            auto dash = line.find(" - ");
+            if (dash == std::string::npos ||
+                line.compare(dash + 3, 8, "cgroup2 ") != 0)
+                continue;
+
+            std::istringstream fields(line.substr(0, dash));
+            std::string id, parent, dev, root, mount;
+            fields >> id >> parent >> dev >> root >> mount;
+            return mount;
+        }
+        throw std::runtime_error("No cgroup v2 hierarchy is mounted.");
+    }
+
+    // This process's own cgroup directory.
+    static std::string current() {
+        std::ifstream self("/proc/self/cgroup");
+        std::string line;
+        while (std::getline(self, line)) {
+            if (line.rfind("0::", 0) == 0) {
+                std::string rel = line.substr(3);
+                return mount_point() + (rel == "/" ? "" : rel);
+            }
+        }
+        throw std::runtime_error("This process is not in a cgroup v2 group.");
+    }
+
+    const std::string &path() const noexcept { return path_; }
+
+    // For clone3()'s cgroup argument.
+    native_handle_t native_handle() const noexcept { return dir_.get(); }
+
+    void apply(const resource_limits &limits) {
+        if (limits.cpu_max) {
+            constexpr uint64_t period = 100000;
+            auto quota = static_cast<uint64_t>(*limits.cpu_max * period);
+            write("cpu.max", std::to_string(quota ? quota : 1) + " " +
+                                 std::to_string(period));
+        }
+        if (limits.memory_max)
+            write("memory.max", std::to_string(*limits.memory_max));
+        if (limits.pids_max)
+            write("pids.max", std::to_string(*limits.pids_max));
+        if (limits.io_weight)
+            write("io.weight", "default " + std::to_string(*limits.io_weight));
+    }
+
+    // Moves an already running process in. Racy compared to starting it
+    // here with clone3(): the process runs unconstrained until this returns.
+    void attach(pid_t pid) { write("cgroup.procs", std::to_string(pid)); }
+
+    // SIGKILLs everything in the group (cgroup.kill, Linux 5.14+).
+    bool kill() noexcept {
+        try {
+            write("cgroup.kill", "1");
+            return true;
+        } catch (...) {
+            return false;
+        }
+    }
+
+    // The processes currently in the group (cgroup.procs).
+    std::vector<pid_t> procs() const {
+        std::ifstream in(path_ + "/cgroup.procs");
+        std::vector<pid_t> pids;
+        pid_t pid;
+        while (in >> pid)
+            pids.push_back(pid);
+        return pids;
+    }
+
+    // Sends `signal` to every process in the group. Returns false if there
+    // was nobody to signal. Unlike kill(), a process forking at that moment
+    // can slip through.
+    bool signal(int signal) const {
+        bool sent = false;
+        for (pid_t pid : procs())
+            sent |= ::kill(pid, signal) == 0;
+        return sent;
+    }
+
+    bool populated() const {
+        return read_key("cgroup.events", "populated").value_or(0) != 0;
+    }
+
+    cgroup_usage usage() const {
+        auto cpu = [this](const char *key) {
+            return read_key("cpu.stat", key).value_or(0);
+        };
+
+        cgroup_usage u;
+        if (auto peak = read_file("memory.peak"))
+            u.memory_peak = std::stoull(*peak);
+        u.cpu_usage    = std::chrono::microseconds(cpu("usage_usec"));
+        u.cpu_user     = std::chrono::microseconds(cpu("user_usec"));
+        u.cpu_system   = std::chrono::microseconds(cpu("system_usec"));
+        u.nr_throttled = cpu("nr_throttled");
+        u.throttled    = std::chrono::microseconds(cpu("throttled_usec"));
+        u.oom_kills    = read_key("memory.events", "oom_kill").value_or(0);
+        return u;
+    }
+
+  private:
+    explicit cgroup(std::string path) : path_(std::move(path)) {}
+
+    static std::runtime_error error(const std::string &what) {
+        return std::runtime_error(what + ": " + native::last_error());
+    }
+
+    static void
+    enable_controllers(const std::string &parent, const resource_limits &l) {
+        std::vector<std::string> wanted;
+        if (l.cpu_max)
+            wanted.push_back("cpu");
+        if (l.memory_max)
+            wanted.push_back("memory");
+        if (l.pids_max)
+            wanted.push_back("pids");
+        if (l.io_weight)
+            wanted.push_back("io");
+        if (wanted.empty())
+            return;
+
+        std::string enabled = slurp(parent + "/cgroup.subtree_control");
+        std::istringstream words(enabled);
+        std::vector<std::string> have{
+            std::istream_iterator<std::string>(words),
+            std::istream_iterator<std::string>()
+        };
+
+        std::string change;
+        for (auto &c : wanted) {
+            if (std::find(have.begin(), have.end(), c) == have.end())
+                change += (change.empty() ? "+" : " +") + c;
+        }
+        if (change.empty())
+            return;
+
+        if (!slurp(parent + "/cgroup.procs").empty() &&
+            parent != mount_point())
+            throw std::runtime_error(
+                "Cannot enable " + change + " for children of " + parent +
+                ": it holds processes, which cgroup v2 only allows at the "
+                "root. Pass an empty, delegated cgroup as the parent."
+            );
+        put(parent + "/cgroup.subtree_control", change);
+    }
+
+    void write(const char *file, const std::string &value) const {
+        put(path_ + "/" + file, value);
+    }
+
+    static void put(const std::string &file, const std::string &value) {
+        handle fd(::open(file.c_str(), O_WRONLY | O_CLOEXEC));
+        if (!fd.valid())
+            throw error("Cannot open " + file);
+        if (::write(fd.get(), value.data(), value.size()) < 0)
+            throw error("Cannot write '" + value + "' to " + file);
+    }
+
+    static std::string slurp(const std::string &file) {
+        std::ifstream in(file);
+        if (!in)
+            throw error("Cannot read " + file);
+        std::ostringstream text;
+        text << in.rdbuf();
+        return text.str();
+    }
+
+    std::optional<std::string> read_file(const char *file) const {
+        std::ifstream in(path_ + "/" + file);
+        std::string value;
+        if (!in || !std::getline(in, value))
+            return std::nullopt;
+        return value;
+    }
+
+    // The value of `key` in a flat-keyed file such as cpu.stat.
+    std::optional<uint64_t>
+    read_key(const char *file, const std::string &key) const {
+        std::ifstream in(path_ + "/" + file);
+        std::string name;
+        uint64_t value;
+        while (in >> name >> value) {
+            if (name == key)
+                return value;
+        }
+        return std::nullopt;
+    }
+
+    void remove() noexcept {
+        if (path_.empty())
+            return;
+        dir_.reset();
+        if (::rmdir(path_.c_str()) == 0 || errno != EBUSY)
+            return;
+
+        // Something the child left behind is still running in here.
+        kill();
+        for (int i = 0; i < 100; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (::rmdir(path_.c_str()) == 0 || errno != EBUSY)
+                return;
+        }
+    }
+};
+
+} // namespace posix
+} // namespace proc
+#endif
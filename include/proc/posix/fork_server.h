@@ -0,0 +1,469 @@
+#pragma once
+#ifdef __linux__
+#include "../exit_state.h"
+#include "../handle.h"
+#include "../pipe/native_io.h"
+#include "spawn.h"
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace proc::posix {
+
+// A small helper process, forked once while the parent is still small,
+// that performs spawns on the parent's behalf. Requests travel over a
+// SOCK_SEQPACKET socket with the redirected stdio descriptors attached as
+// SCM_RIGHTS; the helper replies with the child's pid and later relays its
+// wait status and rusage. The large parent therefore never forks.
+//
+// start() must be called before the parent creates any threads: the helper
+// is a plain fork() of the caller and keeps running C++ code afterwards.
+class fork_server {
+    enum message_type : uint32_t {
+        spawn_message   = 1,
+        spawned_message = 2,
+        exited_message  = 3,
+    };
+
+    struct request_header {
+        uint32_t type;
+        uint32_t path_len;
+        uint64_t id;
+        uint32_t cwd_len;
+        uint32_t argv_len;
+        uint32_t env_len;
+        int32_t process_group;
+        int8_t fd_index[3];
+    };
+
+    struct reply {
+        uint32_t type;
+        int32_t pid;
+        uint64_t id;
+        int32_t error;
+        int32_t status;
+        rusage usage;
+    };
+
+    static constexpr size_t max_message = 256 * 1024;
+    static constexpr const char *lost_message =
+        "The fork server exited before reporting the child's status.";
+
+    handle socket_;
+    pid_t server_pid_ = -1;
+    std::thread relay_;
+
+    std::mutex mutex_;
+    uint64_t next_id_ = 1;
+    std::unordered_map<uint64_t, std::promise<reply>> pending_;
+    std::unordered_map<pid_t, std::shared_ptr<exit_state>> children_;
+    // Set once the helper has gone away; spawn() fails from then on.
+    bool dead_ = false;
+
+    fork_server() = default;
+
+  public:
+    fork_server(const fork_server &)            = delete;
+    fork_server &operator=(const fork_server &) = delete;
+
+    ~fork_server() {
+        if (socket_.valid())
+            ::shutdown(socket_.get(), SHUT_RDWR);
+        if (relay_.joinable())
+            relay_.join();
+        if (server_pid_ > 0) {
+            int status;
+            while (::waitpid(server_pid_, &status, 0) < 0 && errno == EINTR) {
+            }
+        }
+    }
+
+    // Forks the helper. Call once, early in main().
+    static fork_server &start() {
+        std::lock_guard lock(instance_mutex());
+        auto &inst = instance_ptr();
+        if (!inst) {
+            std::unique_ptr<fork_server> server(new fork_server());
+            server->launch();
+            inst = std::move(server);
+        }
+        return *inst;
+    }
+
+    // The running helper, or nullptr if start() was never called.
+    static fork_server *instance() {
+        std::lock_guard lock(instance_mutex());
+        return instance_ptr().get();
+    }
+
+    pid_t server_pid() const noexcept { return server_pid_; }
+
+    // Spawns `req` in the helper and returns the child's pid. `state` is
+    // completed when the helper reaps the child.
+    pid_t spawn(const spawn_request &req, std::shared_ptr<exit_state> state) {
+        std::string payload;
+        request_header hdr{};
+        hdr.type = spawn_message;
+
+        auto append = [&](const char *s) {
+            size_t n = s ? std::strlen(s) : 0;
+            payload.append(s ? s : "", n);
+            return static_cast<uint32_t>(n);
+        };
+        auto append_list = [&](char *const *list) {
+            size_t before = payload.size();
+            for (; list && *list; ++list)
+                payload.append(*list, std::strlen(*list) + 1);
+            return static_cast<uint32_t>(payload.size() - before);
+        };
+
+        hdr.path_len = append(req.path);
+        hdr.cwd_len  = append(req.working_directory);
+        hdr.argv_len = append_list(req.argv);
+        hdr.env_len  = append_list(req.envp);
+
+        hdr.process_group = req.process_group;
+
+        int fds[3];
+        int nfds             = 0;
+        const int sources[3] = {req.stdin_fd, req.stdout_fd, req.stderr_fd};
+        for (int i = 0; i < 3; ++i) {
+            hdr.fd_index[i] = -1;
+            if (sources[i] < 0)
+                continue;
+            for (int j = 0; j < nfds; ++j) {
+                if (fds[j] == sources[i])
+                    hdr.fd_index[i] = static_cast<int8_t>(j);
+            }
+            if (hdr.fd_index[i] < 0) {
+                hdr.fd_index[i] = static_cast<int8_t>(nfds);
+                fds[nfds++]     = sources[i];
+            }
+        }
+
+        if (sizeof(hdr) + payload.size() > max_message)
+            throw std::runtime_error(
+                "Spawn request too large for fork server."
+            );
+
+        std::future<reply> answer;
+        {
+            std::lock_guard lock(mutex_);
+            if (dead_)
+                throw std::runtime_error("The fork server has exited.");
+            hdr.id = next_id_++;
+            answer = pending_[hdr.id].get_future();
+        }
+
+        std::string message(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        message += payload;
+        if (!send_with_fds(
+                socket_.get(), message.data(), message.size(), fds, nfds
+            )) {
+            std::lock_guard lock(mutex_);
+            pending_.erase(hdr.id);
+            throw std::runtime_error(
+                "Sending to fork server failed: " + native::last_error()
+            );
+        }
+
+        reply r = answer.get();
+        if (r.error != 0) {
+            throw std::runtime_error(
+                std::string("posix_spawn in fork server failed: ") +
+                std::strerror(r.error)
+            );
+        }
+
+        // A short-lived child may already have exited, in which case the
+        // relay parked its status under the pid.
+        {
+            std::unique_lock lock(mutex_);
+            auto it = children_.find(r.pid);
+            if (it != children_.end()) {
+                state->set(it->second->status(), it->second->usage());
+                children_.erase(it);
+            } else if (!dead_) {
+                children_[r.pid] = std::move(state);
+            } else {
+                lock.unlock();
+                state->fail(lost_message);
+            }
+        }
+
+        return r.pid;
+    }
+
+  private:
+    static std::mutex &instance_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unique_ptr<fork_server> &instance_ptr() {
+        static std::unique_ptr<fork_server> inst;
+        return inst;
+    }
+
+    void launch() {
+        int sv[2];
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+            throw std::runtime_error(
+                "socketpair failed: " + native::last_error()
+            );
+
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            ::close(sv[0]);
+            ::close(sv[1]);
+            throw std::runtime_error("fork failed: " + native::last_error());
+        }
+
+        if (pid == 0) {
+            ::close(sv[0]);
+            serve(sv[1]);
+        }
+
+        ::close(sv[1]);
+        socket_.reset(sv[0]);
+        server_pid_ = pid;
+        relay_      = std::thread([this]() { relay(); });
+    }
+
+    // Parent side: routes spawn replies to their callers and exit
+    // notifications to the matching exit_state.
+    void relay() {
+        reply r;
+        while (true) {
+            ssize_t n = ::recv(socket_.get(), &r, sizeof(r), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n != static_cast<ssize_t>(sizeof(r)))
+                break;
+
+            std::lock_guard lock(mutex_);
+            if (r.type == spawned_message) {
+                auto it = pending_.find(r.id);
+                if (it != pending_.end()) {
+                    it->second.set_value(r);
+                    pending_.erase(it);
+                }
+            } else if (r.type == exited_message) {
+                auto it = children_.find(r.pid);
+                if (it != children_.end()) {
+                    it->second->set(r.status, r.usage);
+                    children_.erase(it);
+                } else {
+                    // spawn() has not registered the pid yet.
+                    auto early = std::make_shared<exit_state>();
+                    early->set(r.status, r.usage);
+                    children_[r.pid] = std::move(early);
+                }
+            }
+        }
+
+        // The helper is gone; fail anything still waiting on it. Nobody will
+        // report the exit of the children it spawned either.
+        std::unordered_map<pid_t, std::shared_ptr<exit_state>> orphans;
+        {
+            std::lock_guard lock(mutex_);
+            dead_ = true;
+            for (auto &[id, promise] : pending_) {
+                reply failed{};
+                failed.type  = spawned_message;
+                failed.id    = id;
+                failed.error = EPIPE;
+                promise.set_value(failed);
+            }
+            pending_.clear();
+            orphans.swap(children_);
+        }
+
+        // Statuses parked for spawn() are already set and left as they are.
+        for (auto &[pid, state] : orphans)
+            state->fail(lost_message);
+    }
+
+    static bool send_with_fds(
+        int sock, const void *data, size_t size, const int *fds, int nfds
+    ) {
+        iovec iov{const_cast<void *>(data), size};
+        msghdr msg{};
+        msg.msg_iov    = &iov;
+        msg.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+        if (nfds > 0) {
+            msg.msg_control    = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+            cmsghdr *cm        = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level     = SOL_SOCKET;
+            cm->cmsg_type      = SCM_RIGHTS;
+            cm->cmsg_len       = CMSG_LEN(sizeof(int) * nfds);
+            std::memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+        }
+
+        while (true) {
+            ssize_t n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+            if (n >= 0)
+                return true;
+            if (errno != EINTR)
+                return false;
+        }
+    }
+
+    static void send_reply(int sock, const reply &r) {
+        while (::send(sock, &r, sizeof(r), MSG_NOSIGNAL) < 0) {
+            if (errno != EINTR)
+                ::_exit(0);
+        }
+    }
+
+    // Helper side. Never returns.
+    [[noreturn]] static void serve(int sock) {
+        sigset_t chld;
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        ::sigprocmask(SIG_BLOCK, &chld, nullptr);
+        int sig_fd = ::signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+
+        std::vector<char> buffer(max_message);
+
+        while (true) {
+            pollfd fds[2] = {{sock, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+            if (::poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                ::_exit(1);
+            }
+
+            if (fds[1].revents & POLLIN) {
+                signalfd_siginfo info;
+                while (::read(sig_fd, &info, sizeof(info)) > 0) {
+                }
+                reap_children(sock);
+            }
+
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!handle_request(sock, buffer))
+                    ::_exit(0);
+            }
+        }
+    }
+
+    static void reap_children(int sock) {
+        while (true) {
+            int status = 0;
+            rusage usage{};
+            pid_t pid = ::wait4(-1, &status, WNOHANG, &usage);
+            if (pid <= 0)
+                return;
+
+            reply r{};
+            r.type   = exited_message;
+            r.pid    = pid;
+            r.status = status;
+            r.usage  = usage;
+            send_reply(sock, r);
+        }
+    }
+
+    static bool handle_request(int sock, std::vector<char> &buffer) {
+        iovec iov{buffer.data(), buffer.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        do {
+            n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return false;
+
+        int fds[3] = {-1, -1, -1};
+        int nfds   = 0;
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+             cm          = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                continue;
+            nfds = static_cast<int>(
+                (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int)
+            );
+            std::memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfds);
+        }
+
+        request_header hdr;
+        reply r{};
+        r.type = spawned_message;
+
+        if (static_cast<size_t>(n) < sizeof(hdr)) {
+            r.error = EINVAL;
+        } else {
+            std::memcpy(&hdr, buffer.data(), sizeof(hdr));
+            r.id = hdr.id;
+
+            const char *p = buffer.data() + sizeof(hdr);
+            std::string path(p, hdr.path_len);
+            p += hdr.path_len;
+            std::string cwd(p, hdr.cwd_len);
+            p += hdr.cwd_len;
+
+            auto split = [](const char *data, size_t len) {
+                std::vector<std::string> out;
+                for (size_t i = 0; i < len;) {
+                    size_t l = std::strlen(data + i);
+                    out.emplace_back(data + i, l);
+                    i += l + 1;
+                }
+                return out;
+            };
+
+            argv_block argv(split(p, hdr.argv_len));
+            p += hdr.argv_len;
+            argv_block env(split(p, hdr.env_len));
+
+            spawn_request req;
+            req.path              = path.empty() ? nullptr : path.c_str();
+            req.argv              = argv.data();
+            req.envp              = hdr.env_len ? env.data() : nullptr;
+            req.working_directory = cwd.empty() ? nullptr : cwd.c_str();
+            req.process_group     = hdr.process_group;
+
+            int *targets[3] = {&req.stdin_fd, &req.stdout_fd, &req.stderr_fd};
+            for (int i = 0; i < 3; ++i) {
+                if (hdr.fd_index[i] >= 0 && hdr.fd_index[i] < nfds)
+                    *targets[i] = fds[hdr.fd_index[i]];
+            }
+
+            pid_t pid = -1;
+            r.error   = try_spawn(req, pid);
+            r.pid     = pid;
+        }
+
+        for (int i = 0; i < nfds; ++i)
+            ::close(fds[i]);
+
+        send_reply(sock, r);
+        return true;
+    }
+};
+
+} // namespace proc::posix
+#endif
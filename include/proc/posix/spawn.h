@@ -0,0 +1,434 @@
+#pragma once
+#ifndef _WIN32
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif
+
+extern char **environ;
+
+namespace proc::posix {
+
+// Splits a command line the way a POSIX shell would split plain words:
+// whitespace separates arguments, quotes group them and a backslash escapes
+// the next character (except inside single quotes).
+inline std::vector<std::string> split_command_line(const std::string &cmd) {
+    std::vector<std::string> args;
+    std::string current;
+    bool in_word = false;
+    char quote   = 0;
+
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        char ch = cmd[i];
+
+        if (quote) {
+            if (ch == quote) {
+                quote = 0;
+            } else if (ch == '\\' && quote == '"' && i + 1 < cmd.size()) {
+                current += cmd[++i];
+            } else {
+                current += ch;
+            }
+            continue;
+        }
+
+        if (ch == '\'' || ch == '"') {
+            quote   = ch;
+            in_word = true;
+        } else if (ch == '\\' && i + 1 < cmd.size()) {
+            current += cmd[++i];
+            in_word = true;
+        } else if (ch == ' ' || ch == '\t' || ch == '\n') {
+            if (in_word) {
+                args.push_back(std::move(current));
+                current.clear();
+                in_word = false;
+            }
+        } else {
+            current += ch;
+            in_word = true;
+        }
+    }
+
+    if (in_word)
+        args.push_back(std::move(current));
+
+    return args;
+}
+
+// Owns a null-terminated `char *const[]` suitable for execve/posix_spawn.
+class argv_block {
+    std::vector<std::string> storage_;
+    std::vector<char *> ptrs_;
+
+  public:
+    argv_block() = default;
+
+    explicit argv_block(std::vector<std::string> args)
+        : storage_(std::move(args)) {
+        rebuild();
+    }
+
+    argv_block(const argv_block &)            = delete;
+    argv_block &operator=(const argv_block &) = delete;
+
+    // Moving may relocate short strings, so the pointer array is rebuilt.
+    argv_block(argv_block &&other) noexcept
+        : storage_(std::move(other.storage_)) {
+        rebuild();
+        other.rebuild();
+    }
+
+    argv_block &operator=(argv_block &&other) noexcept {
+        if (this != &other) {
+            storage_ = std::move(other.storage_);
+            rebuild();
+            other.rebuild();
+        }
+        return *this;
+    }
+
+    bool empty() const noexcept { return storage_.empty(); }
+    size_t size() const noexcept { return storage_.size(); }
+
+    char *const *data() const noexcept {
+        // An empty block allocates nothing.
+        static char *const none[] = {nullptr};
+        return ptrs_.empty() ? none : ptrs_.data();
+    }
+
+  private:
+    void rebuild() {
+        ptrs_.clear();
+        if (storage_.empty())
+            return;
+        ptrs_.reserve(storage_.size() + 1);
+        for (auto &arg : storage_)
+            ptrs_.push_back(arg.data());
+        ptrs_.push_back(nullptr);
+    }
+};
+
+// argv for `cmdline`, falling back to just the application when the command
+// line is empty (mirroring CreateProcessW, whose command line also carries
+// argv[0]).
+inline argv_block
+build_argv(const std::string &application, const std::string &cmdline) {
+    std::vector<std::string> args = split_command_line(cmdline);
+    if (args.empty() && !application.empty())
+        args.push_back(application);
+    if (args.empty())
+        throw std::runtime_error("No application or command line given.");
+    return argv_block(std::move(args));
+}
+
+struct spawn_request {
+    // Executable to run. When null, argv[0] is looked up in PATH.
+    const char *path              = nullptr;
+    char *const *argv             = nullptr;
+    char *const *envp             = nullptr;
+    const char *working_directory = nullptr;
+
+    // Descriptors installed as the child's 0/1/2. Negative values leave the
+    // parent's descriptor in place.
+    int stdin_fd  = -1;
+    int stdout_fd = -1;
+    int stderr_fd = -1;
+
+    // Further descriptors, installed as the child's 3, 4, ... in order. Each
+    // must be numbered above the last of those targets.
+    const int *inherit_fds  = nullptr;
+    size_t inherit_fd_count = 0;
+
+    // Process group for the child: negative keeps it in ours, 0 makes it the
+    // leader of a new group, anything else joins that group (see proc::job).
+    pid_t process_group = -1;
+
+#ifdef __linux__
+    // A cgroup v2 directory (see posix::cgroup) to start the child in.
+    int cgroup_fd = -1;
+
+    // Path of a terminal to become the child's controlling terminal. The
+    // child starts a new session, which also makes it the leader of a new
+    // process group, so process_group must then be negative or 0.
+    const char *controlling_tty = nullptr;
+#endif
+};
+
+#ifdef __linux__
+// The kernel's struct clone_args up to the cgroup field (Linux 5.7), kept
+// here because <linux/sched.h> clashes with <sched.h>.
+struct clone3_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+inline constexpr uint64_t clone_into_cgroup = 0x200000000ULL;
+
+// Spawns the child directly inside req.cgroup_fd with clone3(), so it never
+// runs outside its limits. posix_spawn has no such option in the glibc
+// versions we support. The child is a vfork-style copy: the parent is held
+// until it execs, and an exec failure comes back through a CLOEXEC pipe.
+// Returns 0, an errno value, or ENOSYS if the kernel cannot do it: clone3
+// is missing (before 5.3) or predates the cgroup field (5.3-5.6, which
+// reject the larger struct with E2BIG). Anything else, EINVAL included,
+// is a real error about this request and is returned as is.
+inline int
+try_clone_into_cgroup(const spawn_request &req, pid_t &pid) noexcept {
+    int report[2];
+    if (::pipe2(report, O_CLOEXEC) != 0)
+        return errno;
+
+    clone3_args args{};
+    args.flags       = clone_into_cgroup | CLONE_VFORK;
+    args.exit_signal = SIGCHLD;
+    args.cgroup      = static_cast<uint64_t>(req.cgroup_fd);
+
+    // Nothing may run a signal handler in the child before it execs.
+    sigset_t all, old;
+    sigfillset(&all);
+    ::pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    long rc = ::syscall(SYS_clone3, &args, sizeof(args));
+    if (rc == 0) {
+        const int targets[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        const int sources[3] = {req.stdin_fd, req.stdout_fd, req.stderr_fd};
+        int err              = 0;
+        for (int i = 0; i < 3 && !err; ++i) {
+            if (sources[i] < 0)
+                continue;
+            // dup2 onto itself would leave O_CLOEXEC set.
+            if (sources[i] == targets[i]
+                    ? ::fcntl(targets[i], F_SETFD, 0) != 0
+                    : ::dup2(sources[i], targets[i]) < 0)
+                err = errno;
+        }
+        for (size_t i = 0; i < req.inherit_fd_count && !err; ++i) {
+            if (::dup2(req.inherit_fds[i], STDERR_FILENO + 1 + int(i)) < 0)
+                err = errno;
+        }
+        if (!err && req.controlling_tty) {
+            // A session leader without a terminal acquires the first one it
+            // opens.
+            int tty = -1;
+            if (::setsid() < 0 ||
+                (tty = ::open(req.controlling_tty, O_RDWR)) < 0)
+                err = errno;
+            else
+                ::close(tty);
+        } else if (!err && req.process_group >= 0 &&
+                   ::setpgid(0, req.process_group) != 0) {
+            err = errno;
+        }
+        if (!err && req.working_directory && ::chdir(req.working_directory))
+            err = errno;
+
+        if (!err) {
+            sigset_t none;
+            sigemptyset(&none);
+            ::pthread_sigmask(SIG_SETMASK, &none, nullptr);
+
+            char *const *envp = req.envp ? req.envp : environ;
+            if (req.path)
+                ::execve(req.path, req.argv, envp);
+            else
+                ::execvpe(req.argv[0], req.argv, envp);
+            err = errno;
+        }
+
+        (void)!::write(report[1], &err, sizeof(err));
+        ::_exit(127);
+    }
+
+    int saved = errno;
+    ::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    ::close(report[1]);
+    if (rc < 0) {
+        ::close(report[0]);
+        return saved == E2BIG ? ENOSYS : saved;
+    }
+
+    int err = 0;
+    ssize_t n;
+    do {
+        n = ::read(report[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    ::close(report[0]);
+
+    if (n == sizeof(err) && err != 0) {
+        int status;
+        while (::waitpid(static_cast<pid_t>(rc), &status, 0) < 0 &&
+               errno == EINTR) {
+        }
+        return err;
+    }
+
+    pid = static_cast<pid_t>(rc);
+    return 0;
+}
+#endif
+
+// Spawns a child with posix_spawn. Every descriptor the library creates is
+// O_CLOEXEC, so the only ones the child inherits are the dup2'd stdio fds
+// and the spawn cost does not grow with the parent's descriptor table.
+// Returns 0 or an errno value.
+inline int try_spawn(const spawn_request &req, pid_t &pid) noexcept {
+#ifdef __linux__
+    if (req.cgroup_fd >= 0) {
+        // Remembered so kernels before 5.7 are only asked once.
+        static std::atomic<bool> into_cgroup_unsupported = false;
+        if (!into_cgroup_unsupported.load(std::memory_order_relaxed)) {
+            int rc = try_clone_into_cgroup(req, pid);
+            if (rc != ENOSYS)
+                return rc;
+            into_cgroup_unsupported.store(true, std::memory_order_relaxed);
+        }
+
+        // Kernels before 5.7: spawn normally and move the child in. It runs
+        // unconstrained for a moment.
+        spawn_request plain = req;
+        plain.cgroup_fd     = -1;
+        int rc              = try_spawn(plain, pid);
+        if (rc != 0)
+            return rc;
+
+        int procs =
+            ::openat(req.cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        std::string id = std::to_string(pid);
+        bool moved     = procs >= 0 && ::write(procs, id.data(), id.size()) ==
+                                       static_cast<ssize_t>(id.size());
+        int err        = errno;
+        if (procs >= 0)
+            ::close(procs);
+        if (!moved) {
+            ::kill(pid, SIGKILL);
+            int status;
+            while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            }
+            return err ? err : EIO;
+        }
+        return 0;
+    }
+#endif
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+
+    int rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0)
+        return rc;
+
+    rc = posix_spawnattr_init(&attr);
+    if (rc != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return rc;
+    }
+
+    const int targets[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    const int sources[3] = {req.stdin_fd, req.stdout_fd, req.stderr_fd};
+    for (int i = 0; i < 3 && rc == 0; ++i) {
+        if (sources[i] >= 0)
+            rc = posix_spawn_file_actions_adddup2(
+                &actions, sources[i], targets[i]
+            );
+    }
+
+    for (size_t i = 0; i < req.inherit_fd_count && rc == 0; ++i)
+        rc = posix_spawn_file_actions_adddup2(
+            &actions, req.inherit_fds[i], STDERR_FILENO + 1 + int(i)
+        );
+
+#ifdef __linux__
+    // glibc runs setsid() before the file actions, so opening the terminal
+    // (on the first descriptor past the inherited ones, closed again right
+    // away) makes it the new session's controlling terminal.
+    if (rc == 0 && req.controlling_tty) {
+        int slot = STDERR_FILENO + 1 + int(req.inherit_fd_count);
+        rc       = posix_spawn_file_actions_addopen(
+            &actions, slot, req.controlling_tty, O_RDWR, 0
+        );
+        if (rc == 0)
+            rc = posix_spawn_file_actions_addclose(&actions, slot);
+    }
+#endif
+
+    if (rc == 0 && req.working_directory)
+        rc = posix_spawn_file_actions_addchdir_np(
+            &actions, req.working_directory
+        );
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    bool new_session = false;
+#ifdef __linux__
+    new_session = req.controlling_tty != nullptr;
+    if (new_session)
+        flags |= POSIX_SPAWN_SETSID;
+#endif
+    if (rc == 0 && req.process_group >= 0 && !new_session) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        rc = posix_spawnattr_setpgroup(&attr, req.process_group);
+    }
+    if (rc == 0)
+        rc = posix_spawnattr_setsigmask(&attr, &mask);
+    if (rc == 0)
+        rc = posix_spawnattr_setflags(&attr, flags);
+
+    pid = -1;
+    if (rc == 0) {
+        char *const *envp = req.envp ? req.envp : environ;
+        rc = req.path
+                 ? posix_spawn(&pid, req.path, &actions, &attr, req.argv, envp)
+                 : posix_spawnp(
+                       &pid, req.argv[0], &actions, &attr, req.argv, envp
+                   );
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+
+inline pid_t spawn(const spawn_request &req) {
+    pid_t pid;
+    int rc = try_spawn(req, pid);
+    if (rc != 0) {
+#ifdef __linux__
+        const char *call = req.cgroup_fd >= 0 ? "clone3" : "posix_spawn";
+#else
+        const char *call = "posix_spawn";
+#endif
+        throw std::runtime_error(
+            std::string(call) + " failed: " + std::strerror(rc)
+        );
+    }
+    return pid;
+}
+
+} // namespace proc::posix
+#endif
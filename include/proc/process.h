@@ -1,43 +1,116 @@
 #pragma once
-#include <condition_variable>
+#include <algorithm>
+#include <chrono>
 #include <future>
-#include <io/async_reader.h>
 #include <mutex>
-#include <queue>
+#include <span>
 #include <sstream>
 #include <thread>
+#include <utility>
+#ifdef _WIN32
+#include <io/async_reader.h>
+#include <psapi.h>
 #include <winapi/console.h>
 #include <winapi/handle.h>
 #include <winapi/utils.h>
+#else
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
 // #include "proc_handle.hpp"
+#include "environment.h"
+#include "pipe/async_writer.h"
 #include "pipe/pipe.h"
+#include "pipe/tee_pump.h"
 #include "process_options.h"
+#include "reactor.h"
+#include "shared_region.h"
+#include "stats.h"
+#include "uring_engine.h"
+#ifdef _WIN32
 #include "startup_info.h"
+#else
+#include "exit_state.h"
+#include "exit_watcher.h"
+#include "posix/fork_server.h"
+#include "posix/spawn.h"
+#endif
 
 // using namespace winapi;
 
 namespace proc {
 
+#ifdef _WIN32
+using exit_code_t = DWORD;
+using pid_type    = DWORD;
+#else
+using exit_code_t = int;
+using pid_type    = pid_t;
+#endif
+
 class process {
     process_options opts_;
     bool started_ = false;
+    // Written by reap(), which is const.
+    mutable process_lifecycle times_;
 
+#ifdef _WIN32
     win_handle process_handle_;
     win_handle thread_handle_;
     DWORD process_id_ = 0;
+#else
+    pid_t process_id_          = -1;
+    mutable bool reaped_       = false;
+    mutable int wait_status_   = 0;
+
+    mutable rusage usage_{};
+
+    // Set when someone else (the fork server or an exit_watcher) reaps the
+    // child for us.
+    std::shared_ptr<exit_state> shared_exit_;
+#endif
+
+#ifdef __linux__
+    // Copies output into a file on its way to the stdout/stderr pipe (see
+    // process_options::tee_stdout_to_file). The pump is declared last so
+    // it is joined before the file is closed.
+    struct output_tee {
+        handle file;
+        std::unique_ptr<tee_pump> pump;
+    };
+    std::optional<output_tee> stdout_tee_;
+    std::optional<output_tee> stderr_tee_;
+
+    // The child's cgroup, dropped (and a per-process leaf removed) once the
+    // child is reaped and its usage read.
+    mutable std::shared_ptr<posix::cgroup> cgroup_;
+    mutable std::optional<posix::cgroup_usage> cgroup_usage_;
+
+    std::vector<std::unique_ptr<shared_region>> regions_;
+
+    // The slave side of the use_pty() terminal, opened by the child.
+    std::string pty_name_;
+#endif
 
     pipe stdin_pipe_;
     pipe stdout_pipe_;
     pipe stderr_pipe_;
 
-    std::thread stdout_thread_;
-    std::thread stderr_thread_;
-
-    std::mutex stdin_mutex_;
-    std::condition_variable stdin_cv_;
-    std::queue<std::string> stdin_queue_;
+    // Started by the first write_stdin(). Declared after the pipes so it is
+    // stopped before the stdin pipe closes under it.
+    std::unique_ptr<async_writer> async_stdin_writer_;
     bool stdin_closed_             = false;
+    bool pipes_created_            = false;
+
+    // Shared, prebuilt environment (see launch_many). Null inherits ours.
+    const environment_block* environment_ = nullptr;
 
+#ifdef _WIN32
     BOOL inherit_handles_override_ = FALSE;
 
     const wchar_t* working_dir() const noexcept {
@@ -55,40 +128,108 @@ class process {
                    ? TRUE
                    : FALSE;
     }
+#endif
 
   public:
-    process() = default;
+    process() { times_.created = stats_clock::now(); }
 
-    process(const process_options& opts) : opts_(std::move(opts)) {}
+    process(const process_options& opts) : opts_(std::move(opts)) {
+        times_.created = stats_clock::now();
+    }
 
     process(process&& other) noexcept
-        : process_handle_(std::move(other.process_handle_)),
+        : opts_(std::move(other.opts_)), started_(other.started_),
+          times_(other.times_),
+#ifdef _WIN32
+          process_handle_(std::move(other.process_handle_)),
           thread_handle_(std::move(other.thread_handle_)),
+          process_id_(std::exchange(other.process_id_, {})),
+#else
+          process_id_(std::exchange(other.process_id_, {})),
+          reaped_(other.reaped_), wait_status_(other.wait_status_),
+          usage_(other.usage_),
+          shared_exit_(std::move(other.shared_exit_)),
+#endif
+#ifdef __linux__
+          stdout_tee_(std::move(other.stdout_tee_)),
+          stderr_tee_(std::move(other.stderr_tee_)),
+          cgroup_(std::move(other.cgroup_)),
+          cgroup_usage_(std::move(other.cgroup_usage_)),
+          regions_(std::move(other.regions_)),
+          pty_name_(std::move(other.pty_name_)),
+#endif
           stdin_pipe_(std::move(other.stdin_pipe_)),
           stdout_pipe_(std::move(other.stdout_pipe_)),
           stderr_pipe_(std::move(other.stderr_pipe_)),
-          stdout_thread_(std::move(other.stdout_thread_)),
-          stderr_thread_(std::move(other.stderr_thread_)),
-          started_(other.started_), opts_(std::move(other.opts_)),
-          stdin_closed_(other.stdin_closed_) {}
+          async_stdin_writer_(std::move(other.async_stdin_writer_)),
+          stdin_closed_(other.stdin_closed_),
+          pipes_created_(other.pipes_created_),
+          environment_(other.environment_) {}
 
     process& operator=(process&& other) noexcept {
         if (this != &other) {
-            wait();
+            try {
+                wait();
+            } catch (...) {
+                // The old child's status was lost; there is nothing to wait
+                // for.
+            }
+#ifdef _WIN32
             process_handle_ = std::move(other.process_handle_);
             thread_handle_  = std::move(other.thread_handle_);
+#else
+            reaped_      = other.reaped_;
+            wait_status_ = other.wait_status_;
+            usage_       = other.usage_;
+            shared_exit_ = std::move(other.shared_exit_);
+#endif
+            process_id_     = std::exchange(other.process_id_, {});
             stdin_pipe_     = pipe(std::move(other.stdin_pipe_));
             stdout_pipe_    = pipe(std::move(other.stdout_pipe_));
             stderr_pipe_    = pipe(std::move(other.stderr_pipe_));
-            stdout_thread_  = std::move(other.stdout_thread_);
-            stderr_thread_  = std::move(other.stderr_thread_);
             started_        = other.started_;
             opts_           = std::move(other.opts_);
+            async_stdin_writer_ = std::move(other.async_stdin_writer_);
             stdin_closed_   = other.stdin_closed_;
+            pipes_created_  = other.pipes_created_;
+            environment_    = other.environment_;
+            times_          = other.times_;
+#ifdef __linux__
+            stdout_tee_   = std::move(other.stdout_tee_);
+            stderr_tee_   = std::move(other.stderr_tee_);
+            cgroup_       = std::move(other.cgroup_);
+            cgroup_usage_ = std::move(other.cgroup_usage_);
+            regions_      = std::move(other.regions_);
+            pty_name_     = std::move(other.pty_name_);
+#endif
         }
         return *this;
     }
 
+#ifndef _WIN32
+    // A child dropped before it was reaped is handed to someone who will
+    // reap it, so it doesn't linger as a zombie. Children reaped through
+    // shared_exit_ already have one.
+    ~process() {
+        if (process_id_ <= 0 || reaped_ || shared_exit_ || reap(WNOHANG))
+            return;
+        try {
+#ifdef __linux__
+            exit_watcher::shared().watch(
+                process_id_, std::make_shared<exit_state>()
+            );
+#else
+            std::thread([pid = process_id_]() {
+                int status = 0;
+                while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                }
+            }).detach();
+#endif
+        } catch (...) {
+        }
+    }
+#endif
+
     process(const process&)            = delete;
     process& operator=(const process&) = delete;
 
@@ -124,6 +265,7 @@ class process {
 
         start_impl(opts_.application, opts_.command_line);
         started_ = true;
+        begin_captures();
     }
 
     void
@@ -132,9 +274,16 @@ class process {
             throw std::runtime_error("Process already started.");
         }
 
+#ifdef _WIN32
         start(application, winapi::string_to_wstring(command_line));
+#else
+        start_impl(application, command_line);
+        started_ = true;
+        begin_captures();
+#endif
     }
 
+#ifdef _WIN32
     void
     start(const fs::path application, const std::wstring& command_line = L"") {
         if (started_) {
@@ -143,6 +292,7 @@ class process {
 
         start_impl(application, command_line);
         started_ = true;
+        begin_captures();
     }
 
     bool kill(UINT exit_code = 1) {
@@ -152,6 +302,14 @@ class process {
         BOOL result = TerminateProcess(process_handle_.get(), exit_code);
         return result != 0;
     }
+#else
+    bool kill(int signal = SIGKILL) {
+        if (process_id_ <= 0 || reaped_)
+            return false;
+
+        return ::kill(process_id_, signal) == 0;
+    }
+#endif
 
     static process
     launch(const std::string& cmd_line, process_options opts = {}) {
@@ -182,15 +340,156 @@ class process {
     }
 
     void wait() {
+#ifdef _WIN32
         if (process_handle_.valid()) {
             ::WaitForSingleObject(process_handle_.get(), INFINITE);
+            if (times_.reaped == stats_clock::time_point{}) {
+                times_.exit_observed = times_.reaped = stats_clock::now();
+                metrics_sink::add(&metrics_sink::reaped);
+            }
         }
+#else
+        reap(0);
+#endif
+#ifdef __linux__
+        // Once the child is gone the tees finish on their own; joining them
+        // means the files are complete when wait() returns.
+        for (auto* tee : {&stdout_tee_, &stderr_tee_}) {
+            if (*tee && (*tee)->pump)
+                (*tee)->pump->join();
+        }
+#endif
+
+        // Nobody is left to read what is still queued. The writer stays
+        // around so later write_stdin() and flush_stdin() calls throw
+        // instead of starting a new one.
+        if (async_stdin_writer_)
+            async_stdin_writer_->stop();
 
-        // if (async_stdin_writer_) async_stdin_writer_->stop();
         // if (async_stdout_) async_stdout_->stop();
         // if (async_stderr_) async_stderr_->stop();
     }
 
+    // Waits up to `timeout` for the child to exit. Returns true if it has.
+    template <typename Rep, typename Period>
+    bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(timeout);
+#ifdef _WIN32
+        if (!process_handle_.valid())
+            return false;
+        return ::WaitForSingleObject(
+                   process_handle_.get(), static_cast<DWORD>(ms.count())
+               ) == WAIT_OBJECT_0;
+#else
+        if (reap(WNOHANG))
+            return true;
+        if (process_id_ <= 0)
+            return false;
+
+        if (shared_exit_)
+            return shared_exit_->wait_for(ms) && reap(WNOHANG);
+
+#ifdef __linux__
+        handle pidfd(open_pidfd(process_id_));
+        if (pidfd.valid()) {
+            pollfd fd{pidfd.get(), POLLIN, 0};
+            auto deadline = std::chrono::steady_clock::now() + ms;
+            while (true) {
+                auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()
+                );
+                int rc = ::poll(
+                    &fd, 1, static_cast<int>(std::max<int64_t>(left.count(), 0))
+                );
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                if (rc > 0)
+                    note_exit_observed();
+                return reap(WNOHANG);
+            }
+        }
+#endif
+
+        // No pidfd: poll with a short backoff.
+        auto deadline = std::chrono::steady_clock::now() + ms;
+        auto delay    = std::chrono::microseconds(100);
+        while (!reap(WNOHANG)) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+            std::this_thread::sleep_for(delay);
+            delay = std::min(delay * 2, std::chrono::microseconds(10000));
+        }
+        return true;
+#endif
+    }
+
+#ifdef __linux__
+    // Runs `handler` on the shared exit_watcher's thread once the child
+    // exits (immediately if it already has). From then on the watcher owns
+    // reaping; wait() and friends keep working.
+    void on_exit(exit_handler handler) {
+        if (process_id_ <= 0)
+            throw std::runtime_error("Process not started.");
+
+        if (!shared_exit_) {
+            if (reaped_) {
+                handler(exit_info::from_status(wait_status_, usage_));
+                return;
+            }
+            shared_exit_ = std::make_shared<exit_state>();
+            exit_watcher::shared().watch(process_id_, shared_exit_);
+        }
+
+        shared_exit_->on_exit(std::move(handler));
+    }
+
+    // What the child's cgroup consumed (see process_options::with_limits()),
+    // once the child has been reaped. For a shared group this covers every
+    // member so far.
+    std::optional<posix::cgroup_usage> cgroup_usage() const {
+        reap(WNOHANG);
+        return cgroup_usage_;
+    }
+
+    // Resizes a use_pty() child's terminal. The child gets SIGWINCH.
+    void resize_pty(unsigned short rows, unsigned short cols) {
+        winsize size{rows, cols, 0, 0};
+        if (!opts_.pty_ || !stdout_pipe_.read_end().valid() ||
+            ::ioctl(stdout_pipe_.read_handle(), TIOCSWINSZ, &size) != 0)
+            throw std::runtime_error("The process has no terminal to resize.");
+    }
+
+    // Path of a use_pty() child's terminal (/dev/pts/N), empty without one.
+    const std::string& pty_name() const noexcept { return pty_name_; }
+
+    // The parent's end of a region from process_options::with_shared_region().
+    shared_region& region(const std::string& name) {
+        for (auto& r : regions_) {
+            if (r->name() == name)
+                return *r;
+        }
+        throw std::runtime_error("No shared region named " + name + ".");
+    }
+
+    // Suspends on executor::current() until the child exits, then returns
+    // exit_code(). Waits on a pidfd; kernels without one block in wait().
+    task<int> async_wait() {
+        if (process_id_ <= 0)
+            throw std::runtime_error("Process not started.");
+
+        if (!reap(WNOHANG)) {
+            handle pidfd(open_pidfd(process_id_));
+            if (pidfd.valid()) {
+                co_await executor::current().readable(pidfd.get());
+                note_exit_observed();
+            }
+            reap(0);
+        }
+        co_return exit_code();
+    }
+#endif
+
+#ifdef _WIN32
     DWORD exit_code() const {
         DWORD code = 0;
         if (process_handle_.valid()) {
@@ -199,39 +498,180 @@ class process {
         return code;
     }
 
-    bool is_running() const { return exit_code() == STILL_ACTIVE; }
+    // Asks the kernel rather than comparing exit_code() to STILL_ACTIVE,
+    // which a child is free to exit with.
+    bool is_running() const {
+        return process_handle_.valid() &&
+               ::WaitForSingleObject(process_handle_.get(), 0) == WAIT_TIMEOUT;
+    }
 
     HANDLE native_handle() const { return process_handle_.get(); }
+#else
+    // Exit status as a shell reports it: the child's exit code, or
+    // 128 + signal number when it was killed by a signal. Returns 0 while
+    // the child is still running.
+    int exit_code() const {
+        if (!reap(WNOHANG))
+            return 0;
+        if (WIFEXITED(wait_status_))
+            return WEXITSTATUS(wait_status_);
+        if (WIFSIGNALED(wait_status_))
+            return 128 + WTERMSIG(wait_status_);
+        return 0;
+    }
 
-    void write_stdin(const std::string& data) {
-        if (!started_ || !opts_.redirect_stdin_) {
-            throw std::runtime_error(
-                "Process not started or stdin not redirected"
-            );
+    // The signal that terminated the child, or 0 if it exited normally or
+    // is still running.
+    int signal() const {
+        if (!reap(WNOHANG) || !WIFSIGNALED(wait_status_))
+            return 0;
+        return WTERMSIG(wait_status_);
+    }
+
+    bool is_running() const { return process_id_ > 0 && !reap(WNOHANG); }
+
+    pid_t native_handle() const { return process_id_; }
+
+    // Resource usage of the reaped child (zeroed until then).
+    rusage usage() const {
+        if (!reap(WNOHANG))
+            return rusage{};
+        return shared_exit_ ? shared_exit_->usage() : usage_;
+    }
+#endif
+
+    pid_type id() const noexcept { return process_id_; }
+
+    // Lifecycle timestamps, traffic on each redirected pipe and, once the
+    // child has been reaped, its resource usage.
+    process_stats stats() const {
+        process_stats s;
+        s.stdin_pipe  = stdin_pipe_.write_stats();
+        s.stdout_pipe = stdout_pipe_.read_stats();
+        s.stderr_pipe = stderr_pipe_.read_stats();
+
+#ifdef _WIN32
+        FILETIME created, exited, kernel, user;
+        if (process_handle_.valid() && !is_running() &&
+            ::GetProcessTimes(
+                process_handle_.get(), &created, &exited, &kernel, &user
+            )) {
+            // 100 ns units.
+            auto us = [](const FILETIME& ft) {
+                return std::chrono::microseconds(
+                    ((uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) /
+                    10
+                );
+            };
+            s.usage.user_cpu   = us(user);
+            s.usage.system_cpu = us(kernel);
+
+            PROCESS_MEMORY_COUNTERS memory{};
+            if (::K32GetProcessMemoryInfo(
+                    process_handle_.get(), &memory, sizeof(memory)
+                ))
+                s.usage.max_rss_bytes = memory.PeakWorkingSetSize;
         }
+#else
+        if (reap(WNOHANG)) {
+            rusage u = usage();
+            auto us  = [](const timeval& tv) {
+                return std::chrono::microseconds(
+                    int64_t(tv.tv_sec) * 1000000 + tv.tv_usec
+                );
+            };
+            s.usage.user_cpu   = us(u.ru_utime);
+            s.usage.system_cpu = us(u.ru_stime);
+            // Kilobytes on Linux, bytes on macOS.
+#ifdef __APPLE__
+            s.usage.max_rss_bytes = uint64_t(u.ru_maxrss);
+#else
+            s.usage.max_rss_bytes = uint64_t(u.ru_maxrss) * 1024;
+#endif
+            s.usage.voluntary_switches   = uint64_t(u.ru_nvcsw);
+            s.usage.involuntary_switches = uint64_t(u.ru_nivcsw);
+        }
+#endif
 
-        // async_stdin_writer_->write(data);
+        s.times                   = times_;
+        s.times.first_stdout_byte = s.stdout_pipe.first_chunk;
+        return s;
     }
 
+    // Queues `data` for the child's stdin and returns without waiting for
+    // the child to read it. Consecutive writes are coalesced into batched
+    // writes by a background thread. Blocks only while more than
+    // process_options::stdin_high_water_mark bytes are still queued. After
+    // the first call, don't write to standard_in() directly.
+    void write_stdin(std::string data) {
+        stdin_writer().write(std::move(data));
+    }
+
+    // Like write_stdin(), but returns false instead of blocking when the
+    // queue is at the high-water mark. `data` is left untouched then.
+    bool try_write_stdin(std::string& data) {
+        return stdin_writer().try_write(data);
+    }
+
+    // Blocks until everything queued by write_stdin() has reached the pipe.
+    void flush_stdin() {
+        if (async_stdin_writer_)
+            async_stdin_writer_->flush();
+    }
+
+    // Bytes queued by write_stdin() that the child has not taken yet.
+    uint64_t stdin_pending_bytes() const noexcept {
+        return async_stdin_writer_ ? async_stdin_writer_->pending_bytes() : 0;
+    }
+
+    // Sends EOF once everything queued has been written. Rethrows a write
+    // error (such as the child exiting before reading it all).
     void close_stdin() {
         if (!started_ || !opts_.redirect_stdin_)
             return;
 
+        std::exception_ptr error;
+        if (async_stdin_writer_) {
+            try {
+                async_stdin_writer_->close();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            async_stdin_writer_.reset();
+        }
+
         stdin_pipe_.close_read();
         stdin_pipe_.close_write();
+        stdin_closed_ = true;
+
+        if (error)
+            std::rethrow_exception(error);
     }
 
+#ifdef _WIN32
     void close_handles() {
         CloseHandle(process_handle_.get());
         CloseHandle(thread_handle_.get());
     }
+#endif
 
     pipe& standard_out() { return stdout_pipe_; }
     pipe& standard_error() { return stderr_pipe_; }
     pipe& standard_in() { return stdin_pipe_; }
 
+    // The output kept by process_options::capture_tail() and friends. Safe
+    // to call while the child is running; once it has exited, whatever is
+    // still in the pipe is collected first.
+    captured_output captured_stdout() {
+        return captured(stdout_pipe_, "stdout");
+    }
+
+    captured_output captured_stderr() {
+        return captured(stderr_pipe_, "stderr");
+    }
+
     void begin_read_stdout(proc_handler handler = nullptr) {
-        if (!handler) {
+        if (!handler && !stdout_pipe_.is_capturing()) {
             if (!opts_.stdout_handler) {
                 throw std::runtime_error(
                     "No (std) output handler was supplied."
@@ -240,11 +680,23 @@ class process {
             handler = opts_.stdout_handler;
         }
 
-        stdout_pipe_.begin_read(std::move(handler));
+#ifdef __linux__
+        if (opts_.io_reactor) {
+            stdout_pipe_.begin_read(std::move(handler), *opts_.io_reactor);
+            return;
+        }
+#endif
+
+        stdout_pipe_.set_read_batching(
+            opts_.output_batch_window, opts_.output_batch_bytes
+        );
+        stdout_pipe_.begin_read(
+            std::move(handler), opts_.read_buffer_size
+        );
     }
 
     void begin_read_stderr(proc_handler handler = nullptr) {
-        if (!handler) {
+        if (!handler && !stderr_pipe_.is_capturing()) {
             if (!opts_.stderr_handler) {
                 throw std::runtime_error(
                     "No (std) error handler was supplied."
@@ -253,7 +705,28 @@ class process {
             handler = opts_.stderr_handler;
         }
 
-        stderr_pipe_.begin_read(std::move(handler));
+#ifdef __linux__
+        if (opts_.io_reactor) {
+            stderr_pipe_.begin_read(std::move(handler), *opts_.io_reactor);
+            return;
+        }
+#endif
+
+        stderr_pipe_.set_read_batching(
+            opts_.output_batch_window, opts_.output_batch_bytes
+        );
+        stderr_pipe_.begin_read(
+            std::move(handler), opts_.read_buffer_size
+        );
+    }
+
+    // Synchronously streams the child's stdout line by line until EOF.
+    size_t for_each_line(const proc_handler& handler) {
+        return stdout_pipe_.for_each_line(handler);
+    }
+
+    size_t for_each_stderr_line(const proc_handler& handler) {
+        return stderr_pipe_.for_each_line(handler);
     }
 
     void end_read_stdout() { stdout_pipe_.end_read(); }
@@ -261,48 +734,238 @@ class process {
     void end_read_stderr() { stderr_pipe_.end_read(); }
 
   private:
-    void start_impl(const fs::path application, const std::wstring& cmdline) {
-        startup_info si;
+    friend std::vector<process>
+    launch_many(std::span<process_options>, size_t);
 
-        if (opts_.redirect_stdin_) {
-            stdin_pipe_     = pipe::create(true, false);
-            si.stdin_handle = win_handle(stdin_pipe_.read_handle());
+    async_writer& stdin_writer() {
+        if (!started_ || !opts_.redirect_stdin_) {
+            throw std::runtime_error(
+                "Process not started or stdin not redirected"
+            );
         }
+        if (stdin_closed_)
+            throw std::runtime_error("Stdin already closed.");
 
-        if (opts_.redirect_stdout_) {
-            stdout_pipe_    = pipe::create(false, true);
-            si.stdin_handle = win_handle(stdout_pipe_.write_handle());
+        if (!async_stdin_writer_) {
+            auto* counters = stdin_pipe_.counters();
+            async_stdin_writer_ = std::make_unique<async_writer>(
+                stdin_pipe_.write_handle(), opts_.stdin_high_water_mark,
+                counters ? &counters->written : nullptr
+            );
         }
+        return *async_stdin_writer_;
+    }
+
+    bool stderr_shares_stdout() const noexcept {
+        return opts_.stderr_to_stdout_ &&
+               (opts_.redirect_stdout_ || opts_.stdout_file_ ||
+                opts_.stdout_handle_ != invalid_native_handle);
+    }
 
+    // Starts recording output for the capture_* options. The pipes are read
+    // from the moment the child starts, so it never blocks on a full pipe.
+    void begin_captures() {
+        if (opts_.stdout_capture_ && opts_.redirect_stdout_) {
+            stdout_pipe_.enable_capture(
+                opts_.stdout_capture_->head, opts_.stdout_capture_->tail
+            );
+            begin_read_stdout(opts_.stdout_handler);
+        }
+        if (opts_.stderr_capture_ && opts_.redirect_stderr_ &&
+            !stderr_shares_stdout()) {
+            stderr_pipe_.enable_capture(
+                opts_.stderr_capture_->head, opts_.stderr_capture_->tail
+            );
+            begin_read_stderr(opts_.stderr_handler);
+        }
+    }
+
+    captured_output captured(pipe& p, const char* name) {
+        if (!p.is_capturing()) {
+            throw std::runtime_error(
+                std::string("No ") + name + " capture was requested."
+            );
+        }
+        if (started_ && !is_running())
+            p.end_read();
+        return p.captured();
+    }
+
+    // Opens a file named by one of the redirect_*_file options. On Windows
+    // the handle is inheritable, since that is how the child receives it.
+    static handle open_redirect(
+        const process_options::file_redirect& file, bool output
+    ) {
+#ifdef _WIN32
+        SECURITY_ATTRIBUTES sa{};
+        sa.nLength        = sizeof(sa);
+        sa.bInheritHandle = TRUE;
+
+        DWORD access = output ? (file.append ? FILE_APPEND_DATA : GENERIC_WRITE)
+                              : GENERIC_READ;
+        DWORD disposition = !output      ? OPEN_EXISTING
+                            : file.append ? OPEN_ALWAYS
+                                          : CREATE_ALWAYS;
+        HANDLE h = ::CreateFileW(
+            file.path.c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+            disposition, FILE_ATTRIBUTE_NORMAL, nullptr
+        );
+        if (h == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error(
+                "Cannot open " + file.path.string() + ": " +
+                winapi::get_last_error()
+            );
+        }
+        return handle(h);
+#else
+        int flags = O_CLOEXEC;
+        if (output)
+            flags |= O_WRONLY | O_CREAT | (file.append ? O_APPEND : O_TRUNC);
+        else
+            flags |= O_RDONLY;
+
+        int fd = ::open(file.path.c_str(), flags, 0666);
+        if (fd < 0) {
+            throw std::runtime_error(
+                "Cannot open " + file.path.string() + ": " +
+                native::last_error()
+            );
+        }
+        return handle(fd);
+#endif
+    }
+
+    // The environment to give the child, or null to inherit ours. The
+    // options' own environment wins over the snapshot launch_many() shares.
+    // Any `extra` variables are added on top of it.
+    const environment_block* child_environment(
+        environment_block& scratch,
+        const std::vector<std::pair<native_string, native_string>>& extra = {}
+    ) const {
+        if (!extra.empty()) {
+            environment_map vars = opts_.environment
+                                       ? *opts_.environment
+                                       : environment_block::current_map();
+            for (auto& [name, value] : extra)
+                vars[name] = value;
+            scratch = environment_block::from(vars);
+            return &scratch;
+        }
+        if (opts_.prepared_ && opts_.prepared_->environment)
+            return &*opts_.prepared_->environment;
+        if (opts_.environment) {
+            scratch = environment_block::from(*opts_.environment);
+            return &scratch;
+        }
+        return environment_;
+    }
+
+    // Creates the redirected pipes ahead of the spawn. Split out so batch
+    // launches can set up every pipe before spawning anything.
+    void create_pipes() {
+        if (pipes_created_)
+            return;
+
+#ifdef __linux__
+        if (opts_.pty_) {
+            create_pty();
+            pipes_created_ = true;
+            return;
+        }
+#endif
+
+        if (opts_.redirect_stdin_)
+            stdin_pipe_ = pipe::create(true, false, opts_.memory_resource_);
+
+        if (opts_.redirect_stdout_)
+            stdout_pipe_ = pipe::create(false, true, opts_.memory_resource_);
+
+        if (opts_.redirect_stderr_ && !stderr_shares_stdout())
+            stderr_pipe_ = pipe::create(false, true, opts_.memory_resource_);
+
+        pipes_created_ = true;
+    }
+
+#ifdef _WIN32
+    void start_impl(const fs::path application, const std::wstring& cmdline) {
+        times_.spawn_started = stats_clock::now();
+        startup_info si;
+
+        create_pipes();
+
+        // Files from the redirect_*_file options. Ours are closed when this
+        // returns; the child holds its own inherited copies.
+        handle stdin_file, stdout_file, stderr_file;
+        if (opts_.stdin_file_)
+            stdin_file = open_redirect(*opts_.stdin_file_, false);
+        if (opts_.stdout_file_)
+            stdout_file = open_redirect(*opts_.stdout_file_, true);
+        if (opts_.stderr_file_)
+            stderr_file = open_redirect(*opts_.stderr_file_, true);
+
+        HANDLE child_stdin  = opts_.redirect_stdin_ ? stdin_pipe_.read_handle()
+                              : stdin_file          ? stdin_file.get()
+                                                    : opts_.stdin_handle_;
+        HANDLE child_stdout = opts_.redirect_stdout_
+                                  ? stdout_pipe_.write_handle()
+                              : stdout_file ? stdout_file.get()
+                                            : opts_.stdout_handle_;
+        HANDLE child_stderr = opts_.stderr_handle_;
         if (opts_.redirect_stderr_) {
-            if (opts_.stderr_to_stdout_ && opts_.redirect_stdout_) {
-                si.stderr_handle = win_handle(stdout_pipe_.write_handle());
-            } else {
-                stderr_pipe_     = pipe::create(false, true);
-                si.stderr_handle = win_handle(stderr_pipe_.write_handle());
-            }
+            child_stderr = stderr_shares_stdout() ? child_stdout
+                                                  : stderr_pipe_.write_handle();
+        } else if (stderr_file) {
+            child_stderr = stderr_file.get();
         }
 
+        if (child_stdin != invalid_native_handle)
+            si.stdin_handle = child_stdin;
+        if (child_stdout != invalid_native_handle)
+            si.stdout_handle = child_stdout;
+        if (child_stderr != invalid_native_handle)
+            si.stderr_handle = child_stderr;
+
         si.set_redirected_handles(
-            si.stdin_handle.get(), si.stdout_handle.get(),
-            si.stderr_handle.get()
+            si.stdin_handle, si.stdout_handle, si.stderr_handle
         );
 
         STARTUPINFOW siw = *si.data();
         bool inherit_    = inherit_handles();
 
+        std::wstring joined;
+        const std::wstring* command = &cmdline;
+        if (cmdline.empty() && !opts_.arguments.empty()) {
+            joined  = join_arguments(opts_.arguments);
+            command = &joined;
+        }
+
+        environment_block own_env;
+        const environment_block* env = child_environment(own_env);
+
+        DWORD flags = opts_.creation_flags;
+        if (env)
+            flags |= CREATE_UNICODE_ENVIRONMENT;
+        // Held until it is in the job, so nothing it starts can escape.
+        if (opts_.job_)
+            flags |= CREATE_SUSPENDED;
+
+        times_.pipes_ready = stats_clock::now();
+
         PROCESS_INFORMATION pi{};
         BOOL success = CreateProcessW(
             application.c_str(),
-            !cmdline.empty() ? const_cast<wchar_t*>(cmdline.c_str()) : nullptr,
-            nullptr, nullptr, inherit_handles(), opts_.creation_flags, nullptr,
-            working_dir(), si.data(), &pi
+            !command->empty() ? const_cast<wchar_t*>(command->c_str())
+                              : nullptr,
+            nullptr, nullptr, inherit_handles(), flags,
+            env ? env->data() : nullptr, working_dir(), si.data(), &pi
         );
 
         if (!success) {
             std::string error_msg = winapi::get_last_error();
+            metrics_sink::add(&metrics_sink::spawn_failures);
             throw std::runtime_error(error_msg);
         }
+        note_spawned();
 
 #ifdef _DEBUG
         std::cout << "stdin read handle: " << stdin_pipe_.read_handle()
@@ -314,13 +977,354 @@ class process {
         process_handle_ = win_handle(pi.hProcess);
         thread_handle_  = win_handle(pi.hThread);
         process_id_     = pi.dwProcessId;
+
+        if (opts_.job_) {
+            if (!::AssignProcessToJobObject(opts_.job_, pi.hProcess)) {
+                std::string error_msg = winapi::get_last_error();
+                ::TerminateProcess(pi.hProcess, 1);
+                throw std::runtime_error(
+                    "Cannot assign process to job: " + error_msg
+                );
+            }
+            if (!(opts_.creation_flags & CREATE_SUSPENDED))
+                ::ResumeThread(pi.hThread);
+        }
     }
+#else
+    void start_impl(const fs::path application, const std::string& cmdline) {
+        times_.spawn_started = stats_clock::now();
+        posix::spawn_request req;
+
+        create_pipes();
+
+        // Files from the redirect_*_file options go to the child as they
+        // are; ours are closed when this returns. Tee'd outputs instead get
+        // a fresh pipe whose contents a tee_pump copies into the file and
+        // forwards into the usual stdout/stderr pipe.
+        handle stdin_file, stdout_file, stderr_file;
+        if (opts_.stdin_file_)
+            stdin_file = open_redirect(*opts_.stdin_file_, false);
+        if (opts_.stdout_file_)
+            stdout_file = open_redirect(*opts_.stdout_file_, true);
+        if (opts_.stderr_file_)
+            stderr_file = open_redirect(*opts_.stderr_file_, true);
+
+        bool tee_stdout = opts_.stdout_file_ && opts_.stdout_file_->tee;
+        bool tee_stderr = opts_.stderr_file_ && opts_.stderr_file_->tee &&
+                          !stderr_shares_stdout();
+        pipe stdout_tee_pipe;
+        pipe stderr_tee_pipe;
+        if (tee_stdout)
+            stdout_tee_pipe = pipe::create();
+        if (tee_stderr)
+            stderr_tee_pipe = pipe::create();
+
+        // Unset handles stay invalid (-1, "inherit").
+        req.stdin_fd = opts_.redirect_stdin_ ? stdin_pipe_.read_handle()
+                       : stdin_file          ? stdin_file.get()
+                                             : opts_.stdin_handle_;
+        req.stdout_fd = tee_stdout ? stdout_tee_pipe.write_handle()
+                        : opts_.redirect_stdout_ ? stdout_pipe_.write_handle()
+                        : stdout_file            ? stdout_file.get()
+                                                 : opts_.stdout_handle_;
+        if (opts_.redirect_stderr_) {
+            req.stderr_fd = stderr_shares_stdout() ? req.stdout_fd
+                            : tee_stderr ? stderr_tee_pipe.write_handle()
+                                         : stderr_pipe_.write_handle();
+        } else {
+            req.stderr_fd = stderr_file ? stderr_file.get()
+                                        : opts_.stderr_handle_;
+        }
+
+        // argv from prepared_launch, the arguments option, or by splitting
+        // the command line.
+        std::string app = application.string();
+        posix::argv_block own_argv;
+        const posix::argv_block* argv = &own_argv;
+        if (opts_.prepared_)
+            argv = &opts_.prepared_->argv;
+        else if (cmdline.empty() && !opts_.arguments.empty())
+            own_argv = posix::argv_block(opts_.arguments);
+        else
+            own_argv = posix::build_argv(app, cmdline);
+
+#ifdef __linux__
+        // Shared regions reach the child as descriptors 3 and up, announced
+        // through its environment.
+        std::vector<std::pair<native_string, native_string>> region_vars;
+        std::vector<int> region_fds;
+        std::vector<handle> lifted_fds;
+        regions_.clear();
+        if (!opts_.shared_regions_.empty()) {
+            if (opts_.via_fork_server_) {
+                throw std::runtime_error(
+                    "Shared regions cannot be combined with the fork server."
+                );
+            }
+            int next = STDERR_FILENO + 1;
+            for (auto& spec : opts_.shared_regions_) {
+                regions_.push_back(shared_region::create(spec.name, spec.size));
+                region_vars.emplace_back(
+                    shared_region::environment_name(spec.name),
+                    shared_region::environment_value(next)
+                );
+                for (int fd : regions_.back()->native_handles()) {
+                    region_fds.push_back(fd);
+                    ++next;
+                }
+            }
+            // A source sitting where an earlier one lands would be
+            // overwritten by that dup2 first.
+            for (int& fd : region_fds) {
+                if (fd >= next)
+                    continue;
+                lifted_fds.emplace_back(::fcntl(fd, F_DUPFD_CLOEXEC, next));
+                if (!lifted_fds.back().valid()) {
+                    throw std::runtime_error(
+                        "fcntl failed: " + native::last_error()
+                    );
+                }
+                fd = lifted_fds.back().get();
+            }
+            req.inherit_fds      = region_fds.data();
+            req.inherit_fd_count = region_fds.size();
+        }
 
-    void join_threads() {
-        if (stdout_thread_.joinable())
-            stdout_thread_.join();
-        if (stderr_thread_.joinable())
-            stderr_thread_.join();
+        environment_block own_env;
+        const environment_block* env = child_environment(own_env, region_vars);
+#else
+        environment_block own_env;
+        const environment_block* env = child_environment(own_env);
+#endif
+
+        std::string cwd = opts_.working_directory.has_value()
+                              ? opts_.working_directory->string()
+                              : std::string();
+
+        req.path              = app.empty() ? nullptr : app.c_str();
+        req.argv              = argv->data();
+        req.working_directory = cwd.empty() ? nullptr : cwd.c_str();
+        req.envp              = env ? env->data() : nullptr;
+        req.process_group     = opts_.process_group_;
+
+        reaped_      = false;
+        wait_status_ = 0;
+        shared_exit_.reset();
+
+#ifdef __linux__
+        cgroup_usage_.reset();
+        cgroup_ = opts_.cgroup_;
+        if (opts_.limits_)
+            cgroup_ =
+                posix::cgroup::create(*opts_.limits_, opts_.cgroup_parent_);
+        if (cgroup_) {
+            if (opts_.via_fork_server_) {
+                throw std::runtime_error(
+                    "Resource limits cannot be combined with the fork server."
+                );
+            }
+            req.cgroup_fd = cgroup_->native_handle();
+        }
+        if (opts_.pty_) {
+            if (opts_.via_fork_server_) {
+                throw std::runtime_error(
+                    "A pty cannot be combined with the fork server."
+                );
+            }
+            if (opts_.process_group_ > 0) {
+                throw std::runtime_error(
+                    "A pty child leads its own session and cannot join a "
+                    "process group."
+                );
+            }
+            req.controlling_tty = pty_name_.c_str();
+        }
+#endif
+
+        times_.pipes_ready = stats_clock::now();
+        try {
+#ifdef __linux__
+            if (opts_.via_fork_server_) {
+                auto* server = posix::fork_server::instance();
+                if (!server) {
+                    throw std::runtime_error(
+                        "Fork server has not been started."
+                    );
+                }
+
+                shared_exit_ = std::make_shared<exit_state>();
+                process_id_  = server->spawn(req, shared_exit_);
+            } else
+#endif
+            {
+                process_id_ = posix::spawn(req);
+            }
+        } catch (...) {
+            metrics_sink::add(&metrics_sink::spawn_failures);
+#ifdef __linux__
+            cgroup_.reset();
+            regions_.clear();
+#endif
+            throw;
+        }
+        note_spawned();
+
+#ifdef __linux__
+        for (auto& r : regions_)
+            r->set_peer(process_id_);
+
+        if (tee_stdout)
+            stdout_tee_ = start_tee(stdout_tee_pipe, stdout_pipe_, stdout_file);
+        if (tee_stderr)
+            stderr_tee_ = start_tee(stderr_tee_pipe, stderr_pipe_, stderr_file);
+#endif
+
+        // The child owns its ends now; keeping ours open would hold off EOF.
+        if (opts_.redirect_stdin_)
+            stdin_pipe_.close_read();
+        if (opts_.redirect_stdout_)
+            stdout_pipe_.close_write();
+        if (opts_.redirect_stderr_ && !stderr_shares_stdout())
+            stderr_pipe_.close_write();
+#ifdef __linux__
+        // Until every slave descriptor but the child's is closed, reading
+        // the master never ends.
+        if (opts_.pty_) {
+            stdin_pipe_.close_read();
+            stdout_pipe_.close_write();
+        }
+#endif
+    }
+
+#ifdef __linux__
+    // Opens the use_pty() terminal and wraps it as the stdout and stdin
+    // pipes: the parent's ends are the master, the child's the slave. The
+    // descriptors are O_CLOEXEC from the start, which openpty() cannot do,
+    // so children spawned concurrently never pick them up.
+    void create_pty() {
+        handle master(::posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC));
+        char name[64];
+        if (!master.valid() || ::grantpt(master.get()) != 0 ||
+            ::unlockpt(master.get()) != 0 ||
+            ::ptsname_r(master.get(), name, sizeof(name)) != 0) {
+            throw std::runtime_error(
+                "Cannot open a pseudo-terminal: " + native::last_error()
+            );
+        }
+
+        winsize size{opts_.pty_->rows, opts_.pty_->cols, 0, 0};
+        ::ioctl(master.get(), TIOCSWINSZ, &size);
+
+        handle slave(::open(name, O_RDWR | O_NOCTTY | O_CLOEXEC));
+        handle slave_in(
+            slave.valid() ? ::fcntl(slave.get(), F_DUPFD_CLOEXEC, 0) : -1
+        );
+        handle master_in(::fcntl(master.get(), F_DUPFD_CLOEXEC, 0));
+        if (!slave_in.valid() || !master_in.valid()) {
+            throw std::runtime_error(
+                std::string("Cannot open ") + name + ": " +
+                native::last_error()
+            );
+        }
+
+        pty_name_    = name;
+        stdout_pipe_ = pipe(
+            master.release(), slave.release(), opts_.memory_resource_
+        );
+        stdin_pipe_ = pipe(
+            slave_in.release(), master_in.release(), opts_.memory_resource_
+        );
+    }
+
+    // Hands the read end of `from` and the write end of `to` to a tee_pump
+    // that copies everything into `file` along the way.
+    static output_tee start_tee(pipe& from, pipe& to, handle& file) {
+        from.close_write();
+        output_tee tee;
+        tee.file = std::move(file);
+        tee.pump = std::make_unique<tee_pump>(
+            std::move(from.read_end()), std::move(to.write_end()),
+            pipe_tap{nullptr, tee.file.get()}
+        );
+        return tee;
+    }
+#endif
+
+    // Collects the child's status once. Returns true when the child has been
+    // reaped (now or earlier).
+    bool reap(int flags) const {
+        if (reaped_)
+            return true;
+        if (process_id_ <= 0)
+            return false;
+
+        if (shared_exit_) {
+            if (flags & WNOHANG) {
+                if (!shared_exit_->exited())
+                    return false;
+            } else {
+                shared_exit_->wait();
+            }
+            if (auto error = shared_exit_->error(); !error.empty())
+                throw std::runtime_error(error);
+            wait_status_         = shared_exit_->status();
+            reaped_              = true;
+            times_.exit_observed = shared_exit_->exited_at();
+            note_reaped();
+            return true;
+        }
+
+        int status = 0;
+        rusage usage{};
+        pid_t rc;
+        do {
+            rc = ::wait4(process_id_, &status, flags, &usage);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc != process_id_)
+            return false;
+
+        wait_status_ = status;
+        usage_       = usage;
+        reaped_      = true;
+        note_exit_observed();
+        note_reaped();
+        return true;
+    }
+
+    void note_reaped() const {
+        times_.reaped = stats_clock::now();
+        metrics_sink::add(&metrics_sink::reaped);
+#ifdef __linux__
+        if (cgroup_) {
+            try {
+                cgroup_usage_ = cgroup_->usage();
+            } catch (...) {
+            }
+            cgroup_.reset();
+        }
+#endif
+    }
+
+    void note_exit_observed() const {
+        if (times_.exit_observed == stats_clock::time_point{})
+            times_.exit_observed = stats_clock::now();
+    }
+
+#endif
+
+    void note_spawned() {
+        times_.spawned = stats_clock::now();
+        metrics_sink::add(&metrics_sink::spawned);
+        metrics_sink::add(
+            &metrics_sink::spawn_ns,
+            static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    times_.spawned - times_.pipes_ready
+                )
+                    .count()
+            )
+        );
     }
 };
 
@@ -1,46 +1,129 @@
 #pragma once
+#ifdef _WIN32
 #include <Windows.h>
+#include <winapi/utils.h>
+#endif
+#include "command_line.h"
+#include "environment.h"
+#include "handle.h"
+#include "io_engine.h"
+#include "pipe/async_writer.h"
+#include "pipe/buffer_pool.h"
+#include "posix/cgroup.h"
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <memory_resource>
 #include <optional>
 #include <string>
 #include <variant>
+#include <vector>
 
 namespace proc {
 
+struct run_options;
+struct run_result;
+
 struct process_options {
     fs::path application;
-    std::wstring command_line;
+    native_string command_line;
+    // The child's argv, argv[0] first, used as-is when command_line is
+    // empty: nothing is split, and on Windows each argument is quoted.
+    std::vector<native_string> arguments;
     optional_path working_directory;
+    // The child's entire environment. Unset, the child inherits ours.
+    std::optional<environment_map> environment;
 
+#ifdef _WIN32
     DWORD creation_flags                   = 0;
+#endif
     optional_bool inherit_handles_override = false;
 
     proc_handler stdout_handler;
     proc_handler stderr_handler;
 
+    // Written to the child's stdin by run().
     std::string stdin_input;
 
+    size_t read_buffer_size = default_read_buffer_size;
+    // Read batching for the stdout/stderr pump threads (see
+    // pipe::set_read_batching()). A zero window delivers every read.
+    std::chrono::microseconds output_batch_window{0};
+    size_t output_batch_bytes = 0;
+
+    // How many bytes process::write_stdin() may queue before it blocks.
+    size_t stdin_high_water_mark = default_write_high_water_mark;
+
+#ifdef __linux__
+    // When set, output handlers are driven by this engine (a reactor or a
+    // uring_engine) instead of a thread per pipe.
+    io_engine *io_reactor = nullptr;
+#endif
+
     process_options &with_application(const fs::path app) {
         application = app;
         return *this;
     }
 
+#ifdef _WIN32
     process_options &with_creation_flags(DWORD flags) {
         creation_flags = flags;
         return *this;
     }
+#endif
 
     process_options &explicitly_inherit_handles(bool inherit = true) {
         inherit_handles_override = inherit;
         return *this;
     }
 
+#ifdef _WIN32
     process_options &with_command_line(const std::string &cmd) {
         return with_command_line(winapi::string_to_wstring(cmd));
     }
+#endif
 
-    process_options &with_command_line(const std::wstring &cmd) {
+    process_options &with_command_line(const native_string &cmd) {
         command_line = cmd;
+        arguments.clear();
+        return *this;
+    }
+
+#ifdef _WIN32
+    process_options &with_arguments(const std::vector<std::string> &args) {
+        std::vector<std::wstring> wide;
+        wide.reserve(args.size());
+        for (auto &arg : args)
+            wide.push_back(winapi::string_to_wstring(arg));
+        return with_arguments(std::move(wide));
+    }
+#endif
+
+    process_options &with_arguments(std::vector<native_string> args) {
+        arguments = std::move(args);
+        command_line.clear();
+        return *this;
+    }
+
+    process_options &with_environment(environment_map vars) {
+        environment = std::move(vars);
+        return *this;
+    }
+
+    // Sets one variable for the child. The first call starts from a copy of
+    // this process's environment.
+    process_options &
+    with_env(const native_string &name, native_string value) {
+        if (!environment)
+            environment = environment_block::current_map();
+        (*environment)[name] = std::move(value);
+        return *this;
+    }
+
+    process_options &without_env(const native_string &name) {
+        if (!environment)
+            environment = environment_block::current_map();
+        environment->erase(name);
         return *this;
     }
 
@@ -50,35 +133,335 @@ struct process_options {
     }
 
     process_options &redirect_stdout_to(proc_handler handler) {
+        redirect_stdout();
+        stdout_handler = std::move(handler);
+        return *this;
+    }
+
+    // Redirects stdout to a pipe the caller reads directly (e.g. through
+    // process::standard_out()).
+    process_options &redirect_stdout() {
         redirect_stdout_ = true;
-        stdout_handler   = std::move(handler);
+        stdout_handle_   = invalid_native_handle;
+        if (stdout_file_ && !stdout_file_->tee)
+            stdout_file_.reset();
         return *this;
     }
 
     process_options &redirect_stderr_to(proc_handler handler) {
         redirect_stderr_ = true;
+        stderr_handle_   = invalid_native_handle;
         stderr_handler   = std::move(handler);
+        if (stderr_file_ && !stderr_file_->tee)
+            stderr_file_.reset();
         return *this;
     }
 
     process_options &redirect_stderr_to_stdout() {
         redirect_stderr_  = true;
         stderr_to_stdout_ = true;
+        stderr_handle_    = invalid_native_handle;
+        stderr_file_.reset();
+        stderr_capture_.reset();
+        return *this;
+    }
+
+    // Keeps only the last `bytes` of stdout, in a fixed-size ring owned by
+    // the stdout pipe; see process::captured_stdout(). Reading starts with
+    // the process, and any stdout_handler still sees every chunk.
+    process_options &capture_tail(size_t bytes) {
+        return capture_head_and_tail(0, bytes);
+    }
+
+    // Like capture_tail(), but also keeps the first `head` bytes, which
+    // tend to hold the command's banner or the first error.
+    process_options &capture_head_and_tail(size_t head, size_t tail) {
+        redirect_stdout();
+        stdout_capture_ = capture_limits{head, tail};
+        return *this;
+    }
+
+    process_options &capture_stderr_tail(size_t bytes) {
+        return capture_stderr_head_and_tail(0, bytes);
+    }
+
+    process_options &capture_stderr_head_and_tail(size_t head, size_t tail) {
+        redirect_stderr_  = true;
+        stderr_to_stdout_ = false;
+        stderr_handle_    = invalid_native_handle;
+        if (stderr_file_ && !stderr_file_->tee)
+            stderr_file_.reset();
+        stderr_capture_ = capture_limits{head, tail};
+        return *this;
+    }
+
+    // Hands the child `path` itself as its stdout (truncated, or appended
+    // to), so the output never passes through this process.
+    process_options &
+    redirect_stdout_to_file(const fs::path &path, bool append = false) {
+        redirect_stdout_ = false;
+        stdout_handle_   = invalid_native_handle;
+        stdout_file_     = file_redirect{path, append, false};
+        stdout_capture_.reset();
+        return *this;
+    }
+
+    process_options &
+    redirect_stderr_to_file(const fs::path &path, bool append = false) {
+        redirect_stderr_  = false;
+        stderr_to_stdout_ = false;
+        stderr_handle_    = invalid_native_handle;
+        stderr_file_      = file_redirect{path, append, false};
+        stderr_capture_.reset();
+        return *this;
+    }
+
+    process_options &redirect_stdin_from_file(const fs::path &path) {
+        redirect_stdin_ = false;
+        stdin_handle_   = invalid_native_handle;
+        stdin_file_     = file_redirect{path, false, false};
+        return *this;
+    }
+
+#ifdef __linux__
+    // Writes stdout to `path` and still delivers it through the stdout pipe
+    // (to the handler or process::standard_out()), which must be drained.
+    // The file copy is made in the kernel with tee(2)/splice(2).
+    process_options &
+    tee_stdout_to_file(const fs::path &path, bool append = false) {
+        redirect_stdout_ = true;
+        stdout_handle_   = invalid_native_handle;
+        stdout_file_     = file_redirect{path, append, true};
+        return *this;
+    }
+
+    process_options &
+    tee_stderr_to_file(const fs::path &path, bool append = false) {
+        redirect_stderr_  = true;
+        stderr_to_stdout_ = false;
+        stderr_handle_    = invalid_native_handle;
+        stderr_file_      = file_redirect{path, append, true};
+        return *this;
+    }
+#endif
+
+    // Installs `h` as the child's stdin, stdout or stderr instead of a pipe
+    // owned by the process. The caller keeps ownership and must keep the
+    // handle open until the process has started; on Windows it has to be
+    // inheritable.
+    process_options &with_stdin_handle(native_handle_t h) {
+        redirect_stdin_ = false;
+        stdin_handle_   = h;
+        stdin_file_.reset();
+        return *this;
+    }
+
+    process_options &with_stdout_handle(native_handle_t h) {
+        redirect_stdout_ = false;
+        stdout_handle_   = h;
+        stdout_file_.reset();
+        stdout_capture_.reset();
+        return *this;
+    }
+
+    process_options &with_stderr_handle(native_handle_t h) {
+        redirect_stderr_  = false;
+        stderr_to_stdout_ = false;
+        stderr_handle_    = h;
+        stderr_file_.reset();
+        stderr_capture_.reset();
+        return *this;
+    }
+
+    process_options &with_read_buffer_size(size_t bytes) {
+        read_buffer_size = bytes;
+        return *this;
+    }
+
+    // Coalesces output read within `window` (up to `max_bytes`, 0 for the
+    // read buffer size) into one handler call.
+    process_options &with_output_batching(
+        std::chrono::microseconds window, size_t max_bytes = 0
+    ) {
+        output_batch_window = window;
+        output_batch_bytes  = max_bytes;
         return *this;
     }
 
+    process_options &with_stdin_high_water_mark(size_t bytes) {
+        stdin_high_water_mark = bytes;
+        return *this;
+    }
+
+    // Allocates the child's pipe buffers and bookkeeping from `resource`
+    // instead of the shared buffer_pool, e.g. a per-thread pool or an arena
+    // for a batch of children. It must outlive the process and its pipes.
+    process_options &with_memory_resource(std::pmr::memory_resource *resource
+    ) {
+        memory_resource_ = resource;
+        return *this;
+    }
+
+#ifdef _WIN32
+    // Assigns the child to a job object before it runs its first
+    // instruction (it is created suspended and resumed once assigned).
+    // The caller keeps ownership of `job`; see proc::job.
+    process_options &with_job(HANDLE job) {
+        job_ = job;
+        return *this;
+    }
+#else
+    // Starts the child in process group `group`, or as the leader of a new
+    // group when it is 0, so that it and its descendants can be signalled
+    // together with killpg(). A child outside the terminal's foreground
+    // group no longer receives the terminal's Ctrl-C.
+    process_options &with_process_group(pid_t group = 0) {
+        process_group_ = group;
+        return *this;
+    }
+#endif
+
+#ifdef __linux__
+    // Spawn through posix::fork_server instead of from this process. The
+    // server must have been started with posix::fork_server::start().
+    process_options &use_fork_server(bool enable = true) {
+        via_fork_server_ = enable;
+        return *this;
+    }
+
+    process_options &with_reactor(io_engine &engine) {
+        io_reactor = &engine;
+        return *this;
+    }
+
+    // Starts the child in a cgroup v2 leaf of its own with these limits,
+    // created under `parent`. Outside the root cgroup `parent` has to be an
+    // empty, delegated cgroup for CPU, memory, pid or I/O limits: the
+    // default, this process's own cgroup, holds this process (see
+    // posix::cgroup::create()). The leaf is removed once the child has been
+    // reaped, and process::cgroup_usage() reports what it consumed.
+    process_options &
+    with_limits(const resource_limits &limits, std::string parent = {}) {
+        limits_        = limits;
+        cgroup_parent_ = std::move(parent);
+        cgroup_.reset();
+        return *this;
+    }
+
+    // Gives the child a shared_region of `size` bytes for bulk data, created
+    // anew for each start. The parent reaches it through process::region()
+    // and the child with shared_region::inherited(name). Not supported with
+    // the fork server.
+    process_options &with_shared_region(std::string name, size_t size) {
+        shared_regions_.push_back({std::move(name), size});
+        return *this;
+    }
+
+    // Runs the child on a new pseudo-terminal of `rows` x `cols`, for tools
+    // that only line-buffer or colorize when attached to a TTY. The terminal
+    // is the child's stdin, stdout, stderr and controlling terminal (the
+    // child leads a new session). Everything it prints, stderr included,
+    // is read through process::standard_out() and the usual readers;
+    // write_stdin() types into it. The terminal echoes input and turns "\n"
+    // into "\r\n" unless the child changes its modes, and closing stdin is
+    // not end of input there (send "\x04"). Not supported with the fork
+    // server or when joining an existing process group.
+    process_options &
+    use_pty(unsigned short rows = 24, unsigned short cols = 80) {
+        pty_ = pty_size{rows, cols};
+        redirect_stdin();
+        redirect_stdout();
+        redirect_stderr_to_stdout();
+        return *this;
+    }
+
+    // Starts the child in an existing group, shared with other children,
+    // e.g. one posix::cgroup::create() per build job.
+    process_options &with_cgroup(std::shared_ptr<posix::cgroup> group) {
+        cgroup_ = std::move(group);
+        limits_.reset();
+        return *this;
+    }
+#endif
+
     process_options &redirect_stdin() {
         redirect_stdin_ = true;
+        stdin_handle_   = invalid_native_handle;
+        stdin_file_.reset();
         return *this;
     }
 
   private:
     friend class process;
+    friend class prepared_launch;
+    friend run_result run(
+        process_options, std::chrono::steady_clock::time_point,
+        const run_options &
+    );
+
+    // argv and environment serialized once by prepared_launch and shared
+    // by every process started from it.
+    struct launch_blocks {
+#ifndef _WIN32
+        posix::argv_block argv;
+#endif
+        std::optional<environment_block> environment;
+    };
+    std::shared_ptr<const launch_blocks> prepared_;
 
     bool redirect_stdin_   = false;
     bool redirect_stdout_  = false;
     bool redirect_stderr_  = false;
     bool stderr_to_stdout_ = false;
+    bool via_fork_server_  = false;
+
+    // Null for the shared buffer_pool.
+    std::pmr::memory_resource *memory_resource_ = nullptr;
+
+    native_handle_t stdin_handle_  = invalid_native_handle;
+    native_handle_t stdout_handle_ = invalid_native_handle;
+    native_handle_t stderr_handle_ = invalid_native_handle;
+
+    struct file_redirect {
+        fs::path path;
+        bool append = false;
+        // Also keep the pipe redirection and copy into the file.
+        bool tee = false;
+    };
+    std::optional<file_redirect> stdin_file_;
+    std::optional<file_redirect> stdout_file_;
+    std::optional<file_redirect> stderr_file_;
+
+    struct capture_limits {
+        size_t head = 0;
+        size_t tail = 0;
+    };
+    std::optional<capture_limits> stdout_capture_;
+    std::optional<capture_limits> stderr_capture_;
+
+#ifdef _WIN32
+    HANDLE job_ = nullptr;
+#else
+    pid_t process_group_ = -1;
+#endif
+
+#ifdef __linux__
+    std::optional<resource_limits> limits_;
+    std::string cgroup_parent_;
+    std::shared_ptr<posix::cgroup> cgroup_;
+
+    struct region_spec {
+        std::string name;
+        size_t size = 0;
+    };
+    std::vector<region_spec> shared_regions_;
+
+    struct pty_size {
+        unsigned short rows = 24;
+        unsigned short cols = 80;
+    };
+    std::optional<pty_size> pty_;
+#endif
 };
 
 } // namespace proc
\ No newline at end of file
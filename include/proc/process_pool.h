@@ -0,0 +1,295 @@
+#pragma once
+#include "process.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+namespace proc {
+
+struct pool_options {
+    // Number of workers kept warm.
+    size_t workers = 4;
+
+    // Recycle a worker after it has served this many requests (0 = never).
+    size_t max_requests = 0;
+
+    // Recycle a worker once it has been alive this long (0 = never).
+    std::chrono::milliseconds max_lifetime{0};
+
+    pool_options &with_workers(size_t n) {
+        workers = n;
+        return *this;
+    }
+
+    pool_options &with_max_requests(size_t n) {
+        max_requests = n;
+        return *this;
+    }
+
+    pool_options &with_max_lifetime(std::chrono::milliseconds lifetime) {
+        max_lifetime = lifetime;
+        return *this;
+    }
+};
+
+struct pool_stats {
+    uint64_t requests = 0;
+    uint64_t spawned  = 0;
+    // Requests served by a worker that was already running, prespawned or
+    // kept from an earlier request.
+    uint64_t spawns_avoided = 0;
+    uint64_t recycled       = 0;
+    uint64_t failed         = 0;
+
+    // Time callers spent waiting for a free worker.
+    std::chrono::nanoseconds total_queue_latency{0};
+    std::chrono::nanoseconds max_queue_latency{0};
+
+    std::chrono::nanoseconds mean_queue_latency() const {
+        if (!requests)
+            return std::chrono::nanoseconds(0);
+        return total_queue_latency / static_cast<int64_t>(requests);
+    }
+};
+
+// Keeps warm copies of one program and routes requests to them, so
+// repeated invocations don't each pay for process creation.
+//
+// Workers speak a framed protocol on stdin/stdout: every request and every
+// response is a varint (LEB128) byte length followed by that many bytes. A
+// worker reads a request frame, writes exactly one response frame and loops
+// until stdin is closed.
+class process_pool {
+    using clock = std::chrono::steady_clock;
+
+    struct worker {
+        process proc;
+        clock::time_point started;
+        size_t served = 0;
+        // Taken from the idle list rather than spawned for this request.
+        bool warm = false;
+    };
+
+    process_options opts_;
+    pool_options pool_opts_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::condition_variable drained_cv_;
+    std::deque<std::unique_ptr<worker>> idle_;
+    size_t live_        = 0;
+    bool shutting_down_ = false;
+    pool_stats stats_;
+
+  public:
+    explicit process_pool(process_options opts, pool_options pool_opts = {})
+        : opts_(std::move(opts)), pool_opts_(pool_opts) {
+        opts_.redirect_stdin().redirect_stdout();
+        if (pool_opts_.workers == 0)
+            pool_opts_.workers = 1;
+
+        for (size_t i = 0; i < pool_opts_.workers; ++i) {
+            idle_.push_back(spawn());
+            ++live_;
+            ++stats_.spawned;
+        }
+    }
+
+    process_pool(const process_pool &)            = delete;
+    process_pool &operator=(const process_pool &) = delete;
+
+    ~process_pool() { shutdown(); }
+
+    // Returns the pool for the given program, creating it on first use.
+    // Pools are keyed by application, command line or arguments, working
+    // directory and environment, so workers started differently are never
+    // shared; `pool_opts` only applies when the pool is created.
+    static process_pool &
+    shared(const process_options &opts, pool_options pool_opts = {}) {
+        using key_type = std::tuple<
+            fs::path, native_string, std::vector<native_string>, fs::path,
+            std::optional<environment_map>>;
+        static std::mutex registry_mutex;
+        static std::map<key_type, std::unique_ptr<process_pool>> registry;
+
+        key_type key(
+            opts.application, opts.command_line, opts.arguments,
+            opts.working_directory.value_or(fs::path()), opts.environment
+        );
+
+        std::lock_guard lock(registry_mutex);
+        auto &pool = registry[key];
+        if (!pool)
+            pool = std::make_unique<process_pool>(opts, pool_opts);
+        return *pool;
+    }
+
+    // Sends one request frame to a free worker and returns its response.
+    // Blocks while all workers are busy. A worker that dies mid-request is
+    // replaced and the call throws.
+    std::string call(std::string_view request) {
+        auto queued = clock::now();
+        auto w      = acquire();
+        auto waited = clock::now() - queued;
+
+        std::string response;
+        try {
+            w->proc.standard_in().send_frame(request);
+            auto frame = w->proc.standard_out().recv_frame();
+            if (!frame)
+                throw std::runtime_error("Pool worker closed its output.");
+            response.assign(frame->data(), frame->size());
+        } catch (...) {
+            discard(std::move(w), true);
+            throw;
+        }
+
+        ++w->served;
+        release(std::move(w), waited);
+        return response;
+    }
+
+    pool_stats stats() const {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+    size_t idle_workers() const {
+        std::lock_guard lock(mutex_);
+        return idle_.size();
+    }
+
+    // Closes every worker's stdin and waits for it to exit. Busy workers
+    // finish their request first; new calls throw.
+    void shutdown() {
+        std::deque<std::unique_ptr<worker>> retiring;
+        {
+            std::lock_guard lock(mutex_);
+            shutting_down_ = true;
+            retiring.swap(idle_);
+        }
+        idle_cv_.notify_all();
+
+        for (auto &w : retiring)
+            retire(*w);
+
+        std::unique_lock lock(mutex_);
+        live_ -= retiring.size();
+        drained_cv_.wait(lock, [this] { return live_ == 0; });
+    }
+
+  private:
+    std::unique_ptr<worker> spawn() {
+        auto w     = std::make_unique<worker>();
+        w->proc    = process(opts_);
+        w->proc.start();
+        w->started = clock::now();
+        return w;
+    }
+
+    std::unique_ptr<worker> acquire() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            if (shutting_down_)
+                throw std::runtime_error("Process pool is shut down.");
+
+            if (!idle_.empty()) {
+                auto w = std::move(idle_.front());
+                idle_.pop_front();
+                w->warm = true;
+                return w;
+            }
+
+            if (live_ < pool_opts_.workers) {
+                ++live_;
+                ++stats_.spawned;
+                lock.unlock();
+                try {
+                    return spawn();
+                } catch (...) {
+                    lock.lock();
+                    ++stats_.failed;
+                    retired_locked();
+                    throw;
+                }
+            }
+
+            idle_cv_.wait(lock);
+        }
+    }
+
+    bool expired(const worker &w) const {
+        if (pool_opts_.max_requests && w.served >= pool_opts_.max_requests)
+            return true;
+        if (pool_opts_.max_lifetime.count() > 0 &&
+            clock::now() - w.started >= pool_opts_.max_lifetime)
+            return true;
+        return false;
+    }
+
+    void release(std::unique_ptr<worker> w, clock::duration waited) {
+        bool recycle = expired(*w);
+        {
+            std::lock_guard lock(mutex_);
+            ++stats_.requests;
+            if (w->warm)
+                ++stats_.spawns_avoided;
+            stats_.total_queue_latency += waited;
+            if (waited > stats_.max_queue_latency)
+                stats_.max_queue_latency =
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        waited
+                    );
+
+            if (!recycle && !shutting_down_) {
+                idle_.push_back(std::move(w));
+                idle_cv_.notify_one();
+                return;
+            }
+
+            if (recycle)
+                ++stats_.recycled;
+        }
+
+        discard(std::move(w), false);
+    }
+
+    // Retires a worker; the next acquire() spawns its replacement.
+    void discard(std::unique_ptr<worker> w, bool failed) {
+        if (failed)
+            w->proc.kill();
+        retire(*w);
+
+        std::lock_guard lock(mutex_);
+        if (failed)
+            ++stats_.failed;
+        retired_locked();
+    }
+
+    // A live worker is gone: lets a waiting caller spawn its replacement,
+    // or shutdown() return once the last one is.
+    void retired_locked() {
+        --live_;
+        idle_cv_.notify_one();
+        if (shutting_down_ && live_ == 0)
+            drained_cv_.notify_all();
+    }
+
+    // Workers are expected to exit once their stdin reaches EOF.
+    static void retire(worker &w) {
+        w.proc.close_stdin();
+        w.proc.wait();
+    }
+};
+
+} // namespace proc
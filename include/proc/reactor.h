@@ -0,0 +1,312 @@
+#pragma once
+#ifdef __linux__
+#include "io_engine.h"
+#include "pipe/buffer_pool.h"
+#include "pipe/native_io.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace proc {
+
+// Multiplexes the read ends of many pipes over one epoll instance and
+// dispatches their handlers from a fixed set of threads. Registrations are
+// EPOLLONESHOT, so each pipe is serviced by at most one thread at a time and
+// its chunks arrive in order. Each reactor thread owns one read buffer, which
+// keeps memory proportional to the thread count rather than the pipe count.
+class reactor : public io_engine {
+    struct registration {
+        native_handle_t fd;
+        proc_handler on_data;
+        std::function<void()> on_close;
+        bool in_flight = false;
+        bool removed   = false;
+        // Read without the lock by unwatch() and watching().
+        std::atomic<bool> closed = false;
+    };
+
+    handle epoll_;
+    handle wake_;
+    size_t buffer_size_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> running_ = true;
+
+    std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::unordered_map<watch_id, std::shared_ptr<registration>> watches_;
+    watch_id next_id_ = 1;
+    // Set, under mutex_, once epoll_wait() has failed for good; every
+    // registration has been closed and no new ones are taken.
+    bool failed_ = false;
+
+    // Reads per wakeup before the pipe is rearmed and another ready
+    // pipe gets a turn.
+    static constexpr int reads_per_wakeup = 16;
+
+  public:
+    explicit reactor(
+        size_t threads = 1, size_t buffer_size = default_read_buffer_size
+    )
+        : buffer_size_(buffer_size ? buffer_size : 1) {
+        epoll_.reset(::epoll_create1(EPOLL_CLOEXEC));
+        if (!epoll_.valid())
+            throw std::runtime_error(
+                "epoll_create1 failed: " + native::last_error()
+            );
+
+        wake_.reset(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+        if (!wake_.valid())
+            throw std::runtime_error("eventfd failed: " + native::last_error());
+
+        epoll_event ev{};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = 0;
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, wake_.get(), &ev) != 0)
+            throw std::runtime_error(
+                "epoll_ctl failed: " + native::last_error()
+            );
+
+        if (threads == 0)
+            threads = 1;
+        threads_.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            threads_.emplace_back([this]() { run(); });
+    }
+
+    reactor(const reactor &)            = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    ~reactor() { stop(); }
+
+    // A process-wide reactor with a single dispatch thread.
+    static reactor &shared() {
+        static reactor instance;
+        return instance;
+    }
+
+    size_t thread_count() const noexcept { return threads_.size(); }
+
+    size_t watch_count() {
+        std::lock_guard lock(mutex_);
+        return watches_.size();
+    }
+
+    bool watching(watch_id id) override {
+        std::lock_guard lock(mutex_);
+        auto it = watches_.find(id);
+        return it != watches_.end() && !it->second->closed;
+    }
+
+    // The descriptor is switched to non-blocking mode.
+    watch_id watch(
+        native_handle_t fd, proc_handler on_data,
+        std::function<void()> on_close = nullptr
+    ) override {
+        if (!on_data)
+            throw std::runtime_error("No read handler was supplied.");
+
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+            throw std::runtime_error("fcntl failed: " + native::last_error());
+
+        auto reg      = std::make_shared<registration>();
+        reg->fd       = fd;
+        reg->on_data  = std::move(on_data);
+        reg->on_close = std::move(on_close);
+
+        watch_id id;
+        {
+            std::lock_guard lock(mutex_);
+            if (failed_)
+                throw std::runtime_error("The reactor has failed.");
+            id = next_id_++;
+            watches_.emplace(id, reg);
+        }
+
+        epoll_event ev{};
+        ev.events   = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = id;
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+            std::lock_guard lock(mutex_);
+            watches_.erase(id);
+            throw std::runtime_error(
+                "epoll_ctl failed: " + native::last_error()
+            );
+        }
+
+        return id;
+    }
+
+    // Waits for an in-flight dispatch to finish and then delivers whatever
+    // is already buffered in the pipe on the calling thread.
+    void unwatch(watch_id id) override {
+        std::shared_ptr<registration> reg;
+        {
+            std::unique_lock lock(mutex_);
+            auto it = watches_.find(id);
+            if (it == watches_.end())
+                return;
+
+            reg          = it->second;
+            reg->removed = true;
+            ::epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, reg->fd, nullptr);
+            idle_cv_.wait(lock, [&]() { return !reg->in_flight; });
+            watches_.erase(id);
+        }
+
+        if (reg->closed)
+            return;
+
+        pooled_buffer buffer = buffer_pool::shared().acquire(buffer_size_);
+        drain(*reg, buffer, -1);
+        reg->closed = true;
+        if (reg->on_close)
+            reg->on_close();
+    }
+
+    void stop() {
+        if (!running_.exchange(false))
+            return;
+
+        uint64_t one = 1;
+        (void)::write(wake_.get(), &one, sizeof(one));
+
+        for (auto &t : threads_) {
+            if (t.joinable())
+                t.join();
+        }
+    }
+
+  private:
+    void run() {
+        pooled_buffer buffer = buffer_pool::shared().acquire(buffer_size_);
+        epoll_event events[64];
+
+        while (running_) {
+            int n = ::epoll_wait(epoll_.get(), events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                // Nothing registered would be serviced again, so tell
+                // every owner now rather than leave them waiting.
+                close_all();
+                return;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.u64 == 0)
+                    continue;
+                dispatch(events[i].data.u64, buffer);
+            }
+        }
+    }
+
+    void dispatch(watch_id id, pooled_buffer &buffer) {
+        std::shared_ptr<registration> reg;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = watches_.find(id);
+            if (it == watches_.end() || it->second->removed)
+                return;
+            reg            = it->second;
+            reg->in_flight = true;
+        }
+
+        bool closed = drain(*reg, buffer, reads_per_wakeup);
+
+        {
+            std::lock_guard lock(mutex_);
+            // After a failure nobody would service this pipe again.
+            closed = closed || failed_;
+            if (closed) {
+                ::epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, reg->fd, nullptr);
+                reg->removed = true;
+            } else if (!reg->removed) {
+                epoll_event ev{};
+                ev.events   = EPOLLIN | EPOLLONESHOT;
+                ev.data.u64 = id;
+                ::epoll_ctl(epoll_.get(), EPOLL_CTL_MOD, reg->fd, &ev);
+            }
+        }
+
+        // Still marked in flight, so unwatch() cannot return while the
+        // close handler runs.
+        if (closed) {
+            reg->closed = true;
+            if (reg->on_close)
+                reg->on_close();
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            reg->in_flight = false;
+            if (closed)
+                watches_.erase(id);
+        }
+        idle_cv_.notify_all();
+    }
+
+    // Closes every registration that isn't being dispatched; those that
+    // are close themselves once dispatch() sees failed_.
+    void close_all() {
+        std::vector<std::pair<watch_id, std::shared_ptr<registration>>> regs;
+        {
+            std::lock_guard lock(mutex_);
+            failed_ = true;
+            for (auto &[id, reg] : watches_) {
+                if (reg->in_flight || reg->removed)
+                    continue;
+                ::epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, reg->fd, nullptr);
+                reg->removed   = true;
+                reg->in_flight = true;
+                regs.emplace_back(id, reg);
+            }
+        }
+
+        for (auto &[id, reg] : regs) {
+            reg->closed = true;
+            if (reg->on_close)
+                reg->on_close();
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            for (auto &[id, reg] : regs) {
+                reg->in_flight = false;
+                watches_.erase(id);
+            }
+        }
+        idle_cv_.notify_all();
+    }
+
+    // Reads until the pipe would block, `budget` reads have been done
+    // (negative for no limit) or EOF. Returns true on EOF or error.
+    static bool drain(registration &reg, pooled_buffer &buffer, int budget) {
+        for (int i = 0; budget < 0 || i < budget; ++i) {
+            ssize_t n = ::read(reg.fd, buffer.data(), buffer.size());
+            if (n > 0) {
+                reg.on_data(buffer.view(static_cast<size_t>(n)));
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return false;
+            return true;
+        }
+        return false;
+    }
+};
+
+} // namespace proc
+#endif
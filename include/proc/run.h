@@ -0,0 +1,262 @@
+#pragma once
+#include "process.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace proc {
+
+struct run_options {
+    // Bytes reserved up front for each of stdout and stderr. Output up to
+    // this size is collected without reallocating.
+    size_t output_size_hint = 64 * 1024;
+    // Past the deadline the child gets SIGTERM, and SIGKILL this much later.
+    // Output is collected for up to the same time again after that, in case
+    // a descendant still holds the pipes open. Windows kills at once.
+    std::chrono::milliseconds kill_grace{2000};
+};
+
+struct run_result {
+    exit_code_t exit_code = 0;
+    // The signal that ended the child, 0 if it exited (always on Windows).
+    int signal = 0;
+    // The child's stdout and stderr. `err` stays empty when
+    // redirect_stderr_to_stdout() merged the two.
+    std::string out;
+    std::string err;
+    std::chrono::steady_clock::duration duration{};
+    child_usage usage;
+    // The deadline passed and the child was killed.
+    bool timed_out = false;
+};
+
+namespace detail {
+
+#ifndef _WIN32
+// A write that cannot raise SIGPIPE: a child that exits without reading
+// shows up as EPIPE.
+inline ssize_t write_without_sigpipe(int fd, const char *data, size_t size) {
+    native::sigpipe_guard guard;
+    ssize_t n = ::write(fd, data, size);
+    if (n < 0 && errno == EPIPE)
+        guard.discard();
+    return n;
+}
+#endif
+
+} // namespace detail
+
+// Starts the process, feeds it opts.stdin_input, collects its stdout and
+// stderr and waits for it, all without deadlocking on a full pipe: the
+// pipes are serviced together from this thread with poll() rather than one
+// after the other. If the child is still running at `deadline` it is
+// terminated along with its process group (see run_options::kill_grace)
+// and the result is flagged timed_out; whatever it wrote until then is
+// kept.
+//
+// run() owns the child's standard streams: stdout and stderr are always
+// redirected (keeping redirect_stderr_to_stdout()), handlers and the
+// capture_* options are ignored, and stdin is only redirected when there is
+// input.
+inline run_result run(
+    process_options opts,
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max(),
+    const run_options &run_opts = {}
+) {
+    using clock = std::chrono::steady_clock;
+
+    opts.stdout_capture_.reset();
+    opts.stderr_capture_.reset();
+    opts.redirect_stdout();
+    opts.redirect_stderr_to(nullptr);
+    opts.stdout_handler = nullptr;
+    std::string input   = std::move(opts.stdin_input);
+    if (!input.empty())
+        opts.redirect_stdin();
+#ifndef _WIN32
+    // With a deadline the child leads a process group of its own, so a
+    // timeout also ends grandchildren that would otherwise keep the pipes
+    // open. A group the caller picked is left alone.
+    bool own_group =
+        deadline != clock::time_point::max() && opts.process_group_ == -1;
+    if (own_group)
+        opts.with_process_group();
+#endif
+
+    run_result result;
+    auto started = clock::now();
+    process p(opts);
+    p.start();
+
+    auto next_step = deadline;
+    int step       = 0;
+    // Called each time next_step passes: SIGTERM, then SIGKILL, then give
+    // up on the pipes.
+    auto escalate = [&] {
+        result.timed_out = true;
+#ifdef _WIN32
+        p.kill();
+        step = 2;
+#else
+        int signal = step == 0 ? SIGTERM : SIGKILL;
+        if (!own_group || ::killpg(p.id(), signal) != 0)
+            p.kill(signal);
+#endif
+        ++step;
+        next_step += run_opts.kill_grace;
+    };
+
+#ifdef _WIN32
+    result.out.reserve(run_opts.output_size_hint);
+    result.err.reserve(run_opts.output_size_hint);
+    // No poll() for anonymous pipes: a pump thread per pipe instead.
+    p.standard_out().begin_read([&](std::string_view data) {
+        result.out.append(data);
+    });
+    if (p.standard_error().read_end().valid()) {
+        p.standard_error().begin_read([&](std::string_view data) {
+            result.err.append(data);
+        });
+    }
+    if (!input.empty()) {
+        p.write_stdin(std::move(input));
+        p.close_stdin();
+    }
+
+    if (deadline == clock::time_point::max())
+        p.wait();
+    else if (!p.wait_for(std::max(deadline - clock::now(), clock::duration{})))
+        escalate();
+    p.wait();
+    p.end_read_stdout();
+    p.end_read_stderr();
+#else
+    struct stream {
+        int fd;
+        std::string *text;
+        size_t used;
+        io_counters *counters;
+    };
+
+    auto reader = [&](pipe &from, std::string &text) {
+        text.resize(run_opts.output_size_hint ? run_opts.output_size_hint
+                                              : 1);
+        auto *counters = from.counters();
+        return stream{from.read_handle(), &text, 0,
+                      counters ? &counters->read : nullptr};
+    };
+    stream out = reader(p.standard_out(), result.out);
+    stream err = p.standard_error().read_end().valid()
+                     ? reader(p.standard_error(), result.err)
+                     : stream{-1, &result.err, 0, nullptr};
+
+    int in_fd         = input.empty() ? -1 : p.standard_in().write_handle();
+    size_t in_written = 0;
+    if (in_fd >= 0)
+        ::fcntl(in_fd, F_SETFL, ::fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+
+    // Reads straight into the result strings, growing them when full.
+    auto drain = [](stream &s) {
+        if (s.used == s.text->size())
+            s.text->resize(s.text->size() * 2);
+        ssize_t n =
+            ::read(s.fd, s.text->data() + s.used, s.text->size() - s.used);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            return;
+        if (n <= 0) {
+            s.fd = -1;
+            return;
+        }
+        s.used += static_cast<size_t>(n);
+        if (s.counters)
+            s.counters->record(static_cast<size_t>(n));
+    };
+
+    while (out.fd >= 0 || err.fd >= 0 || in_fd >= 0) {
+        if (step == 3)
+            break;
+
+        pollfd fds[3] = {
+            {out.fd, POLLIN, 0}, {err.fd, POLLIN, 0}, {in_fd, POLLOUT, 0}
+        };
+        int timeout = -1;
+        if (next_step != clock::time_point::max()) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(
+                next_step - clock::now()
+            );
+            timeout = static_cast<int>(std::clamp<int64_t>(
+                left.count(), 0, std::numeric_limits<int>::max()
+            ));
+        }
+
+        int rc = ::poll(fds, 3, timeout);
+        if (rc < 0 && errno != EINTR)
+            throw std::runtime_error("poll failed: " + native::last_error());
+        if (clock::now() >= next_step) {
+            escalate();
+            continue;
+        }
+        if (rc <= 0)
+            continue;
+
+        if (fds[0].revents)
+            drain(out);
+        if (fds[1].revents)
+            drain(err);
+        if (fds[2].revents) {
+            ssize_t n = detail::write_without_sigpipe(
+                in_fd, input.data() + in_written, input.size() - in_written
+            );
+            if (n > 0)
+                in_written += static_cast<size_t>(n);
+            bool failed = n < 0 && errno != EAGAIN && errno != EINTR;
+            if (failed || in_written == input.size() ||
+                (fds[2].revents & (POLLERR | POLLHUP))) {
+                p.close_stdin();
+                in_fd = -1;
+            }
+        }
+    }
+    result.out.resize(out.used);
+    result.err.resize(err.used);
+
+    while (step < 2 && next_step != clock::time_point::max() &&
+           !p.wait_for(std::max(next_step - clock::now(), clock::duration{})))
+        escalate();
+    p.wait();
+    result.signal = p.signal();
+#endif
+
+    result.exit_code = p.exit_code();
+    result.duration  = clock::now() - started;
+    result.usage     = p.stats().usage;
+    return result;
+}
+
+// run() with a timeout instead of a deadline.
+template <typename Rep, typename Period>
+run_result run(
+    process_options opts, std::chrono::duration<Rep, Period> timeout,
+    const run_options &run_opts = {}
+) {
+    return run(
+        std::move(opts),
+        std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                timeout
+            ),
+        run_opts
+    );
+}
+
+} // namespace proc
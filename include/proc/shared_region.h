@@ -0,0 +1,340 @@
+#pragma once
+#ifdef __linux__
+#include "exit_watcher.h"
+#include "handle.h"
+#include "pipe/native_io.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <new>
+#include <poll.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace proc {
+
+// Shared memory between this process and a child, for payloads too large to
+// push through a pipe 64 KiB at a time. The region is a memfd mapped by
+// both sides and holds a single-producer, single-consumer byte ring: the
+// producer copies (or builds) data straight into the mapping and the
+// consumer reads it in place, so nothing passes through the kernel.
+//
+// The ring indices are lock-free atomics in the mapping itself. A side only
+// sleeps when the ring is full or empty, and then asks the other side for a
+// doorbell: a write to one of two eventfds, sent only when someone is
+// waiting. Either process may be the producer; each direction needs its
+// own region.
+//
+// The parent creates regions through process_options::with_shared_region()
+// and gets them from process::region(); the child picks its end up with
+// shared_region::inherited(name).
+class shared_region {
+    struct header {
+        uint64_t magic;
+        uint64_t capacity;
+        // Bytes ever written and read; their difference is what is queued.
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> writer_waiting;
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> reader_waiting;
+        alignas(64) std::atomic<uint32_t> closed;
+    };
+
+    static constexpr uint64_t region_magic = 0x6e6f696765722d70; // "p-region"
+
+    std::string name_;
+    handle memory_;
+    // Rung by the writer when data arrives, and by the reader when space
+    // frees up.
+    handle data_bell_;
+    handle space_bell_;
+    // A pidfd for the process at the other end, so a wait can end when it
+    // exits instead of hanging.
+    handle peer_;
+    header *header_ = nullptr;
+    char *data_     = nullptr;
+    size_t mapped_  = 0;
+
+  public:
+    shared_region(const shared_region &)            = delete;
+    shared_region &operator=(const shared_region &) = delete;
+
+    ~shared_region() {
+        if (header_)
+            ::munmap(header_, mapped_);
+    }
+
+    // A new region with room for `capacity` bytes in flight. `name` becomes
+    // part of an environment variable, so it is limited to letters, digits
+    // and '_'.
+    static std::unique_ptr<shared_region>
+    create(const std::string &name, size_t capacity) {
+        check_name(name);
+        if (capacity == 0)
+            throw std::runtime_error("Shared region needs a non-zero size.");
+
+        std::unique_ptr<shared_region> region(new shared_region(name));
+        region->memory_.reset(
+            ::memfd_create(("proc-" + name).c_str(), MFD_CLOEXEC)
+        );
+        if (!region->memory_.valid())
+            throw error("memfd_create failed");
+
+        size_t total = sizeof(header) + capacity;
+        if (::ftruncate(region->memory_.get(), static_cast<off_t>(total)) != 0)
+            throw error("Cannot size shared region " + name);
+
+        region->map(total);
+        new (region->header_) header{region_magic, capacity, {0}, {0},
+                                     {0},          {0},      {0}};
+
+        region->data_bell_.reset(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+        region->space_bell_.reset(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+        if (!region->data_bell_.valid() || !region->space_bell_.valid())
+            throw error("eventfd failed");
+        return region;
+    }
+
+    // The child's end of a region its parent created for it.
+    static std::unique_ptr<shared_region> inherited(const std::string &name) {
+        check_name(name);
+        const char *value = std::getenv(environment_name(name).c_str());
+        int memory, data, space;
+        if (!value ||
+            std::sscanf(value, "%d %d %d", &memory, &data, &space) != 3)
+            throw std::runtime_error(
+                "No shared region named " + name + " was inherited."
+            );
+
+        std::unique_ptr<shared_region> region(new shared_region(name));
+        region->memory_.reset(memory);
+        region->data_bell_.reset(data);
+        region->space_bell_.reset(space);
+        // Keep them out of our own children.
+        for (int fd : {memory, data, space})
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        struct stat st;
+        if (::fstat(memory, &st) != 0 ||
+            static_cast<size_t>(st.st_size) < sizeof(header))
+            throw error("Cannot inspect shared region " + name);
+        region->map(static_cast<size_t>(st.st_size));
+        if (region->header_->magic != region_magic ||
+            region->header_->capacity > st.st_size - sizeof(header))
+            throw std::runtime_error(
+                "Descriptor for " + name + " is not a shared region."
+            );
+
+        region->peer_.reset(open_pidfd(::getppid()));
+        return region;
+    }
+
+    // The variable through which the child learns where its end is.
+    static std::string environment_name(const std::string &name) {
+        return "PROC_SHARED_" + name;
+    }
+
+    // Its value when the region's descriptors land on `first_fd` and the
+    // two after it in the child (see native_handles()).
+    static std::string environment_value(int first_fd) {
+        return std::to_string(first_fd) + " " + std::to_string(first_fd + 1) +
+               " " + std::to_string(first_fd + 2);
+    }
+
+    // The memfd and the two doorbells, in the order the child expects them.
+    std::array<native_handle_t, 3> native_handles() const noexcept {
+        return {memory_.get(), data_bell_.get(), space_bell_.get()};
+    }
+
+    // Lets waits notice when `pid`, the other end, has exited.
+    void set_peer(pid_t pid) { peer_.reset(open_pidfd(pid)); }
+
+    const std::string &name() const noexcept { return name_; }
+
+    size_t capacity() const noexcept { return header_->capacity; }
+
+    // Bytes written and not yet consumed.
+    size_t size() const noexcept {
+        return static_cast<size_t>(
+            header_->head.load(std::memory_order_acquire) -
+            header_->tail.load(std::memory_order_acquire)
+        );
+    }
+
+    // Producer side. The free space starting at the write position, up to
+    // the end of the mapping; empty when the ring is full. Fill it, then
+    // commit() what was written.
+    std::span<char> write_buffer() noexcept {
+        uint64_t head = header_->head.load(std::memory_order_relaxed);
+        uint64_t tail = header_->tail.load(std::memory_order_acquire);
+        size_t cap    = header_->capacity;
+        size_t start  = static_cast<size_t>(head % cap);
+        size_t free   = cap - static_cast<size_t>(head - tail);
+        return {data_ + start, std::min(free, cap - start)};
+    }
+
+    void commit(size_t bytes) {
+        header_->head.fetch_add(bytes, std::memory_order_release);
+        ring(header_->reader_waiting, data_bell_);
+    }
+
+    // Consumer side. The queued bytes starting at the read position, up to
+    // the end of the mapping; empty when nothing is queued. Release them
+    // with consume() once done.
+    std::span<const char> read_buffer() const noexcept {
+        uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+        uint64_t head = header_->head.load(std::memory_order_acquire);
+        size_t cap    = header_->capacity;
+        size_t start  = static_cast<size_t>(tail % cap);
+        size_t queued = static_cast<size_t>(head - tail);
+        return {data_ + start, std::min(queued, cap - start)};
+    }
+
+    void consume(size_t bytes) {
+        header_->tail.fetch_add(bytes, std::memory_order_release);
+        ring(header_->writer_waiting, space_bell_);
+    }
+
+    // Copies all of `data` into the ring, blocking while it is full. Throws
+    // if the region was closed or the other process exited.
+    void write(const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            if (header_->closed.load(std::memory_order_acquire))
+                throw std::runtime_error("Shared region " + name_ + " closed.");
+
+            auto room = write_buffer();
+            if (room.empty()) {
+                bool ready = wait(header_->writer_waiting, space_bell_, [&] {
+                    return !write_buffer().empty() ||
+                           header_->closed.load(std::memory_order_acquire);
+                });
+                if (!ready)
+                    throw std::runtime_error(
+                        "The reader of shared region " + name_ + " exited."
+                    );
+                continue;
+            }
+
+            size_t n = std::min(room.size(), size);
+            std::memcpy(room.data(), p, n);
+            commit(n);
+            p += n;
+            size -= n;
+        }
+    }
+
+    // Copies up to `size` queued bytes out, blocking until there is at
+    // least one. Returns 0 once the region is closed (or the writer has
+    // exited) and drained.
+    size_t read(void *out, size_t size) {
+        if (size == 0)
+            return 0;
+
+        auto queued = read_buffer();
+        if (queued.empty()) {
+            wait(header_->reader_waiting, data_bell_, [&] {
+                return !read_buffer().empty() ||
+                       header_->closed.load(std::memory_order_acquire);
+            });
+            queued = read_buffer();
+            if (queued.empty())
+                return 0;
+        }
+
+        size_t n = std::min(queued.size(), size);
+        std::memcpy(out, queued.data(), n);
+        consume(n);
+        return n;
+    }
+
+    // Tells the reader no more data is coming; it sees end-of-data once the
+    // ring drains. Also wakes a writer blocked on a full ring.
+    void close() {
+        header_->closed.store(1, std::memory_order_release);
+        ring(header_->reader_waiting, data_bell_);
+        ring(header_->writer_waiting, space_bell_);
+    }
+
+  private:
+    explicit shared_region(std::string name) : name_(std::move(name)) {}
+
+    static std::runtime_error error(const std::string &what) {
+        return std::runtime_error(what + ": " + native::last_error());
+    }
+
+    static void check_name(const std::string &name) {
+        bool valid = !name.empty() &&
+                     std::all_of(name.begin(), name.end(), [](char ch) {
+                         return (ch >= 'a' && ch <= 'z') ||
+                                (ch >= 'A' && ch <= 'Z') ||
+                                (ch >= '0' && ch <= '9') || ch == '_';
+                     });
+        if (!valid)
+            throw std::runtime_error("Invalid shared region name: " + name);
+    }
+
+    void map(size_t total) {
+        void *base = ::mmap(
+            nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, memory_.get(),
+            0
+        );
+        if (base == MAP_FAILED)
+            throw error("Cannot map shared region " + name_);
+        header_ = static_cast<header *>(base);
+        data_   = static_cast<char *>(base) + sizeof(header);
+        mapped_ = total;
+    }
+
+    // Sends the doorbell if the other side said it is about to sleep.
+    static void ring(std::atomic<uint32_t> &waiting, const handle &bell) {
+        // Pairs with the fence in wait(): either it sees our update, or we
+        // see its flag.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) && waiting.exchange(0)) {
+            uint64_t one = 1;
+            (void)!::write(bell.get(), &one, sizeof(one));
+        }
+    }
+
+    // Sleeps on `bell` until `ready()` holds. Returns false if the other
+    // process exited first.
+    template <typename Ready>
+    bool wait(std::atomic<uint32_t> &waiting, const handle &bell, Ready ready) {
+        while (!ready()) {
+            waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) {
+                waiting.store(0, std::memory_order_relaxed);
+                break;
+            }
+
+            pollfd fds[2] = {{bell.get(), POLLIN, 0}, {peer_.get(), POLLIN, 0}};
+            int rc        = ::poll(fds, peer_.valid() ? 2 : 1, -1);
+            if (rc < 0 && errno != EINTR)
+                throw error("poll failed");
+
+            uint64_t count;
+            if (rc > 0 && fds[0].revents)
+                (void)!::read(bell.get(), &count, sizeof(count));
+            if (rc > 0 && peer_.valid() && fds[1].revents && !ready())
+                return false;
+        }
+        return true;
+    }
+};
+
+} // namespace proc
+#endif
@@ -6,9 +6,11 @@ namespace proc {
 
 struct startup_info {
     STARTUPINFOW si{};
-    win_handle stdin_handle;
-    win_handle stdout_handle;
-    win_handle stderr_handle;
+    // Borrowed, never closed here: they belong to the process's pipes, its
+    // redirect files or the caller.
+    HANDLE stdin_handle  = nullptr;
+    HANDLE stdout_handle = nullptr;
+    HANDLE stderr_handle = nullptr;
 
     startup_info() {
         ZeroMemory(&si, sizeof(STARTUPINFOW));
@@ -0,0 +1,176 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace proc {
+
+using stats_clock = std::chrono::steady_clock;
+
+// Process-wide counters, for feeding a metrics exporter. Nothing is
+// recorded until a sink is installed with metrics_sink::install(); after
+// that every event costs one relaxed atomic add.
+struct metrics_sink {
+    std::atomic<uint64_t> spawned        = 0;
+    std::atomic<uint64_t> spawn_failures = 0;
+    // Total time spent inside spawn calls.
+    std::atomic<uint64_t> spawn_ns       = 0;
+    std::atomic<uint64_t> reaped         = 0;
+    std::atomic<uint64_t> bytes_read     = 0;
+    std::atomic<uint64_t> chunks_read    = 0;
+    std::atomic<uint64_t> bytes_written  = 0;
+    std::atomic<uint64_t> chunks_written = 0;
+
+    // Installs `sink` (or removes it, with nullptr). The sink must outlive
+    // every process and pipe that might report to it.
+    static void install(metrics_sink *sink) noexcept {
+        current_ptr().store(sink, std::memory_order_release);
+    }
+
+    static metrics_sink *current() noexcept {
+        return current_ptr().load(std::memory_order_acquire);
+    }
+
+    static void add(
+        std::atomic<uint64_t> metrics_sink::*counter, uint64_t value = 1
+    ) noexcept {
+        if (auto *sink = current())
+            (sink->*counter).fetch_add(value, std::memory_order_relaxed);
+    }
+
+  private:
+    static std::atomic<metrics_sink *> &current_ptr() noexcept {
+        static std::atomic<metrics_sink *> sink = nullptr;
+        return sink;
+    }
+};
+
+// Traffic through one direction of a pipe.
+struct pipe_stats {
+    uint64_t bytes  = 0;
+    uint64_t chunks = 0;
+    // When the first chunk moved; time_point{} if none has yet.
+    stats_clock::time_point first_chunk;
+};
+
+// Counters updated from whichever thread moves the data (a reader thread,
+// an I/O engine or the caller), read at any time by stats().
+class io_counters {
+    std::atomic<uint64_t> bytes_  = 0;
+    std::atomic<uint64_t> chunks_ = 0;
+    std::atomic<int64_t> first_   = 0;
+    std::atomic<uint64_t> metrics_sink::*sink_bytes_;
+    std::atomic<uint64_t> metrics_sink::*sink_chunks_;
+
+  public:
+    explicit io_counters(bool reading)
+        : sink_bytes_(
+              reading ? &metrics_sink::bytes_read : &metrics_sink::bytes_written
+          ),
+          sink_chunks_(
+              reading ? &metrics_sink::chunks_read
+                      : &metrics_sink::chunks_written
+          ) {}
+
+    void record(size_t bytes) noexcept {
+        if (bytes == 0)
+            return;
+        if (first_.load(std::memory_order_relaxed) == 0) {
+            int64_t expected = 0;
+            first_.compare_exchange_strong(
+                expected, stats_clock::now().time_since_epoch().count(),
+                std::memory_order_relaxed
+            );
+        }
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        chunks_.fetch_add(1, std::memory_order_relaxed);
+        metrics_sink::add(sink_bytes_, bytes);
+        metrics_sink::add(sink_chunks_);
+    }
+
+    pipe_stats snapshot() const noexcept {
+        pipe_stats s;
+        s.bytes  = bytes_.load(std::memory_order_relaxed);
+        s.chunks = chunks_.load(std::memory_order_relaxed);
+        if (int64_t first = first_.load(std::memory_order_relaxed))
+            s.first_chunk =
+                stats_clock::time_point(stats_clock::duration(first));
+        return s;
+    }
+};
+
+// Both directions of one pipe.
+struct pipe_counters {
+    io_counters read{true};
+    io_counters written{false};
+};
+
+// Points in a child's life, as seen from this process. Each is
+// time_point{} until it has happened.
+struct process_lifecycle {
+    stats_clock::time_point created;
+    stats_clock::time_point spawn_started;
+    // Pipes and redirect files are set up; the spawn call follows.
+    stats_clock::time_point pipes_ready;
+    stats_clock::time_point spawned;
+    stats_clock::time_point first_stdout_byte;
+    // When the exit was first noticed (by wait4, a pidfd, the fork server
+    // or an exit_watcher).
+    stats_clock::time_point exit_observed;
+    // When this process object collected the status.
+    stats_clock::time_point reaped;
+};
+
+// Resource usage of the reaped child.
+struct child_usage {
+    std::chrono::microseconds user_cpu{0};
+    std::chrono::microseconds system_cpu{0};
+    uint64_t max_rss_bytes        = 0;
+    uint64_t voluntary_switches   = 0;
+    uint64_t involuntary_switches = 0;
+};
+
+struct process_stats {
+    process_lifecycle times;
+    pipe_stats stdin_pipe;
+    pipe_stats stdout_pipe;
+    pipe_stats stderr_pipe;
+    child_usage usage;
+
+    // Pipe and file setup before the spawn.
+    stats_clock::duration setup_time() const {
+        return between(times.spawn_started, times.pipes_ready);
+    }
+
+    // The spawn call itself (fork/exec, posix_spawn, CreateProcess or the
+    // fork server round trip).
+    stats_clock::duration spawn_time() const {
+        return between(times.pipes_ready, times.spawned);
+    }
+
+    stats_clock::duration time_to_first_byte() const {
+        return between(times.spawned, times.first_stdout_byte);
+    }
+
+    // From noticing the exit to having the status in hand.
+    stats_clock::duration reap_latency() const {
+        return between(times.exit_observed, times.reaped);
+    }
+
+    stats_clock::duration lifetime() const {
+        return between(times.spawned, times.exit_observed);
+    }
+
+  private:
+    // Zero unless both points have been reached.
+    static stats_clock::duration
+    between(stats_clock::time_point from, stats_clock::time_point to) {
+        const stats_clock::time_point never{};
+        if (from == never || to == never)
+            return stats_clock::duration::zero();
+        return to - from;
+    }
+};
+
+} // namespace proc
@@ -1,9 +1,25 @@
 #pragma once
+#include <filesystem>
 #include <functional>
+#include <optional>
 #include <string>
+#include <string_view>
 
 namespace proc {
 
-using proc_handler = std::function<void(const std::string &)>;
+namespace fs = std::filesystem;
 
-}
\ No newline at end of file
+using optional_path = std::optional<fs::path>;
+using optional_bool = std::optional<bool>;
+
+#ifdef _WIN32
+using native_string = std::wstring;
+#else
+using native_string = std::string;
+#endif
+
+// Receives a chunk of child output. The view points into a buffer owned by
+// the reader and is only valid until the handler returns.
+using proc_handler = std::function<void(std::string_view)>;
+
+}